@@ -35,10 +35,12 @@ List of commands:
     apply
     subscribe <path> [type [options]]
       'type' is one of [set, add, delete, all], default is 'all'
-      'options' is a comma separated list of [no_own_events]
+      'options' is a comma separated list of [no_own_events, batch_events,
+        min_interval=<milliseconds>]
     unsubscribe <id>
     checkevents
     template <path> [strict]
+    metrics [reset]
     exit
     help
 ]=]
@@ -81,12 +83,16 @@ local function do_checkevents()
   end
   local data, from = sock:recvfrom()
   while data do
-    local tag, _, _ msg:init_decode(data)
-    if tag == msg.EVENT then
+    local tag = msg:init_decode(data)
+    if tag == msg.tags.EVENT then
       local event = msg:decode()
       if event then
         print(format("EVENT: id=%s, type=%s, path=%s, value=%s", event.id, event.eventmask, event.path, event.value))
       end
+    elseif tag == msg.tags.EVENTS then
+      for _, event in ipairs(msg:decode() or {}) do
+        print(format("EVENT: id=%s, type=%s, path=%s, value=%s", event.id, event.eventmask, event.path, event.value))
+      end
     end
     data, from = sock:recvfrom()
   end
@@ -255,16 +261,25 @@ local function translate_options_to_mask(options)
     return 0
   end
   local options_table = {}
+  local min_interval
   for option in string.gfind(options, "[^,]+") do
-    options_table[option] = true
+    local interval = option:match("^min_interval=(%d+)$")
+    if interval then
+      min_interval = tonumber(interval)
+    else
+      options_table[option] = true
+    end
   end
 
   local options_mask = 0
   if (options_table["no_own_events"]) then
     options_mask = options_mask + 1
   end
+  if (options_table["batch_events"]) then
+    options_mask = options_mask + 8
+  end
 
-  return options_mask
+  return options_mask, min_interval
 end
 
 local function do_subscribe(uuid, path, subscription_type, options)
@@ -276,7 +291,7 @@ local function do_subscribe(uuid, path, subscription_type, options)
   if not typemask then
     return
   end
-  local optionsmask = translate_options_to_mask(options)
+  local optionsmask, min_interval = translate_options_to_mask(options)
   if not optionsmask then
     return
   end
@@ -286,7 +301,7 @@ local function do_subscribe(uuid, path, subscription_type, options)
     return
   end
 
-  local id, paths = proxy.subscribe(uuid, path, event_address, typemask, optionsmask)
+  local id, paths = proxy.subscribe(uuid, path, event_address, typemask, optionsmask, min_interval)
   if not id then
     print("ERROR", paths)
     return
@@ -360,6 +375,22 @@ local function do_template(uuid, path, strict)
   end
 end
 
+local function do_metrics(uuid, reset)
+    local results, errmsg = proxy.getMetrics(uuid, reset == "reset")
+    if not results then
+      print("ERROR", errmsg)
+      return
+    end
+    for _, m in ipairs(results) do
+      if m.buckets then
+        print(format("%s %s: count=%d total=%dus max=%dus [%s]", m.group, m.name, m.count,
+                     m.total, m.max, table.concat(m.buckets, " ")))
+      else
+        print(format("%s %s: %d", m.group, m.name, m.count))
+      end
+    end
+end
+
 local actions = {
     get = do_get,
     count = do_getPC,
@@ -374,6 +405,7 @@ local actions = {
     unsubscribe = do_unsubscribe,
     checkevents = do_checkevents,
     template = do_template,
+    metrics = do_metrics,
     help = do_help,
     __index = function(_, action)
       return function()
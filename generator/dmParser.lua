@@ -13,8 +13,59 @@ See LICENSE file for more details.
 local M = {}
 
 local insert = table.insert
+local find = string.find
+local open, type, ipairs = io.open, type, ipairs
 
-function M.parse(filename, path)
+-- size of the blocks in which the XML file is fed to the parser
+local blocksize = 64 * 1024
+
+--- Check whether an object type is selected.
+-- @param objectType The name of the object type.
+-- @param path A pattern the object type must match or an array of such
+--   patterns. All object types are selected if nil.
+local function isSelected(objectType, path)
+  if not path then
+    return true
+  end
+  if type(path) == 'table' then
+    for _, pattern in ipairs(path) do
+      if find(objectType, pattern) then
+        return true
+      end
+    end
+    return false
+  end
+  return find(objectType, path) ~= nil
+end
+
+--- Feed an XML file to the parser in blocks.
+local function parseFile(callbacks, filename)
+  local parser = require('lxp').new(callbacks)
+  local fileDescriptor = assert(open(filename))
+  while true do
+    local block = fileDescriptor:read(blocksize)
+    if not block then
+      break
+    end
+    parser:parse(block)
+  end
+  parser:parse()
+  parser:close()
+  fileDescriptor:close()
+end
+
+--- Parse a BBF XML datamodel.
+-- @param filename The path of the XML file.
+-- @param path The pattern(s) the selected object types must match.
+-- @param emit (optional) If given, the selected objects are not collected
+--   but this function is called with the name and the attributes of each one
+--   as soon as its element is closed.
+-- @param enums (optional) The enumerations as returned by an earlier parse of
+--   the same file. They are used as is so the enumerations of the emitted
+--   objects are complete, even if other objects add to them later on.
+-- @return The parsed datamodel (only the name if emit is given), the info
+--   about the numEntries parameters and the enumerations.
+local function parse(filename, path, emit, enums)
 
   local dm = {} -- the DM file will be parsed to this table
   local numEntries = {} -- info about the numEntries parameters found
@@ -23,7 +74,8 @@ function M.parse(filename, path)
   local parameter = nil  -- the parameter that is currently parsed
   local parameterName = nil -- the name of the parameter that is currently parsed
   local dataTypeName = nil -- the name of the dataType that is currently parsed
-  local enums = {} -- a local table keeping track of all enumerations used.
+  local complete = (enums ~= nil) -- true if the enumerations are already known
+  enums = enums or {} -- a local table keeping track of all enumerations used.
   local adding = false -- a boolean tracking if we should add to the dm or not.
   local haveAlias = false
 
@@ -190,9 +242,11 @@ function M.parse(filename, path)
         object = attrs
         object["params"] = {}
         haveAlias = false
-        if (not path or string.find(objectType, path)) then
+        if isSelected(objectType, path) then
           adding = true
-          add(dm, objectType, object)
+          if not emit then
+            add(dm, objectType, object)
+          end
         end
       end
 
@@ -279,7 +333,9 @@ function M.parse(filename, path)
               enum = {}
               enums[object["name"]..parameter["name"]] = enum
             end
-            insert(enum,attrs["value"])
+            if not complete then
+              insert(enum,attrs["value"])
+            end
             if not parameter["enumeration"] then
               add(parameter, "enumeration", enum)
             end
@@ -295,7 +351,7 @@ function M.parse(filename, path)
               enum = {}
               enums[refPath] = enum
             end
-            if attrs["nullValue"] then
+            if attrs["nullValue"] and not complete then
               insert(enum,attrs["nullValue"])
             end
             if not parameter["enumeration"] then
@@ -338,6 +394,9 @@ function M.parse(filename, path)
           object[#object+1] = "aliasParameter"
           object.aliasParameter = "Alias"
         end
+        if emit and adding then
+          emit(object["name"], object)
+        end
         object = nil
         adding = false
       end
@@ -357,14 +416,42 @@ function M.parse(filename, path)
   }
 
   -- Parse the XML datamodel using lxp
-  local parser = require('lxp').new(callbacks)
-  local fileDescriptor = io.open(filename)
-  local dmXML = fileDescriptor:read("*all")
-  parser:parse(dmXML)
-  parser:close()
-  fileDescriptor:close()
+  parseFile(callbacks, filename)
 
+  return dm, numEntries, enums
+end
+
+--- Parse a BBF XML datamodel into a table.
+-- @param filename The path of the XML file.
+-- @param path The pattern the object types to parse must match, or an array
+--   of such patterns. All object types are parsed if nil.
+-- @return The datamodel, an ordered table of the object types, and a table
+--   with the numEntries parameters per object type.
+function M.parse(filename, path)
+  local dm, numEntries = parse(filename, path)
   return dm, numEntries
 end
 
+local function discard()
+end
+
+--- Parse a BBF XML datamodel and hand over every selected object type as
+-- soon as its element is closed, instead of building the whole datamodel.
+-- The numEntries parameters of an object are only known once its children
+-- are parsed and a reference to an enumeration can extend it, so a first
+-- pass over the file collects those; only the objects being parsed are
+-- kept in memory.
+-- @param filename The path of the XML file.
+-- @param path The pattern the object types to parse must match, or an array
+--   of such patterns. All object types are parsed if nil.
+-- @param start A function that is called with the name of the datamodel and
+--   the numEntries info (as returned by parse()) before the first object.
+-- @param emit A function that is called with the name and the attributes of
+--   every object type, in the order of the file.
+function M.stream(filename, path, start, emit)
+  local info, numEntries, enums = parse(filename, nil, discard)
+  start(info["name"], numEntries)
+  parse(filename, path, emit, enums)
+end
+
 return M
@@ -63,7 +63,7 @@ extern "C" {
 /**
  * The version of libtransformer you're compiling against.
  */
-#define LIBTRANSFORMER_VERSION 0x000002  // 0.0.2
+#define LIBTRANSFORMER_VERSION 0x000005  // 0.0.5
 
 /**
  * The length of a UUID in bytes.
@@ -130,9 +130,19 @@ typedef enum {
                      location. Possible responses (see ::tf_resp_e) are a `TF_RESP_ADD` response with
                      the instance number or name of the new instance or a `TF_RESP_ERROR` response if
                      the request could not be processed properly. **/
-  TF_REQ_DEL    /**< DeleteObject. Remove the specified object. Possible responses (see ::tf_resp_e)
+  TF_REQ_DEL,   /**< DeleteObject. Remove the specified object. Possible responses (see ::tf_resp_e)
                      are a `TF_RESP_EMPTY` response if the delete was successful or a `TF_RESP_ERROR`
                      response if the request could not be processed properly. **/
+  TF_REQ_GPV_DELTA, /**< Delta GetParameterValues. Like `TF_REQ_GPV` but given the change token of an
+                     earlier delta request only the values that changed since then are retrieved.
+                     Possible responses (see ::tf_resp_e) are zero or more `TF_RESP_GPV` responses
+                     and `TF_RESP_GPV_DELETED` responses for the objects deleted since then,
+                     followed by one `TF_RESP_GPV_TOKEN` response with the new change token, or a
+                     `TF_RESP_ERROR` response if the request could not be processed properly. **/
+  TF_REQ_GPV_FILTER /**< Filtered GetParameterValues. Like `TF_REQ_GPV` but only the named parameters
+                     of the objects that match a filter are retrieved; the getters of the other
+                     parameters are not called. Possible responses (see ::tf_resp_e) are the same
+                     as for `TF_REQ_GPV`. **/
 } tf_req_e;
 
 /**
@@ -198,6 +208,36 @@ typedef struct {
                           Must not be NULL. */
 } tf_req_del_t;
 
+/**
+ * Delta GetParameterValues request item.
+ *
+ * Multiple items of this type can be added to a request; the token of the
+ * first one applies to all of them.
+ */
+typedef struct {
+  const char* token;  /**< The change token of an earlier delta request on the same paths, or
+                           NULL to retrieve all values. */
+  const char* path;   /**< A full or partial datamodel path from which you want to retrieve
+                           values. Must not be NULL. */
+} tf_req_gpv_delta_t;
+
+/**
+ * Filtered GetParameterValues request item.
+ *
+ * Multiple items of this type can be added to a request; the parameter names
+ * and the filter of the first one apply to all of them.
+ */
+typedef struct {
+  const char* path;    /**< A full or partial datamodel path from which you want to retrieve
+                            values. Must not be NULL. */
+  const char* params;  /**< Comma separated names of the parameters to retrieve for the objects
+                            of a partial path, or NULL to retrieve all of them. */
+  const char* filter;  /**< A filter like `Active == "1"` (clauses can be joined with `and`;
+                            `==` and `!=` are the only operators) or
+                            NULL for no filter. Objects having the parameters of the filter that
+                            don't match it are skipped together with their children. */
+} tf_req_gpv_filter_t;
+
 /**
  * A request item.
  *
@@ -217,6 +257,8 @@ typedef struct {
     tf_req_gpc_t gpc;  ///< Request item details in case it's a GetCount.
     tf_req_add_t add;  ///< Request item details in case it's a AddObject.
     tf_req_del_t del;  ///< Request item details in case it's a DeleteObject.
+    tf_req_gpv_delta_t gpv_delta;  ///< Request item details in case it's a Delta GetParameterValues.
+    tf_req_gpv_filter_t gpv_filter;  ///< Request item details in case it's a Filtered GetParameterValues.
   } u;
 } tf_req_t;
 
@@ -254,6 +296,8 @@ typedef enum {
   TF_RESP_SPV_ERROR,   ///< Details of a SetParameterValues error response.
   TF_RESP_GPC,         ///< Details of a GetCount response.
   TF_RESP_ADD,         ///< Details of an AddObject response.
+  TF_RESP_GPV_DELETED, ///< An object deleted since the token of a Delta GetParameterValues request.
+  TF_RESP_GPV_TOKEN,   ///< The new change token of a Delta GetParameterValues request.
 } tf_resp_e;
 
 /**
@@ -310,8 +354,11 @@ typedef struct {
  * GetParameterCount request items.
  */
 typedef struct {
-  uint16_t count;  /**< The number of parameter values that probably would be returned if
-                        a GetParameterValues request was done on the same datamodel paths. */
+  uint32_t count;  /**< The number of parameter values that probably would be returned if
+                        a GetParameterValues request was done on the same datamodel paths.
+                        The instances of multi instance objects below the requested path
+                        are counted as of their last synchronization; an object that was
+                        never synchronized counts as having no instances. */
 } tf_resp_gpc_t;
 
 /**
@@ -323,6 +370,28 @@ typedef struct {
   const char* instance;  ///< The index number or name of the new instance.
 } tf_resp_add_t;
 
+/**
+ * Delta GetParameterValues deleted object response.
+ *
+ * Returned for each object below the requested paths that was deleted
+ * since the change token was handed out.
+ */
+typedef struct {
+  const char* partial_path;  ///< The path of the deleted object.
+} tf_resp_gpv_deleted_t;
+
+/**
+ * Delta GetParameterValues token response.
+ *
+ * Always the last response of a Delta GetParameterValues request.
+ */
+typedef struct {
+  const char* token;  /**< The change token to pass in the next delta request. Empty if no
+                           token could be handed out; the next request then retrieves all values. */
+  bool        full;   /**< True if the given token was unknown or expired and all values were
+                           returned; anything retrieved earlier must then be discarded. */
+} tf_resp_gpv_token_t;
+
 /**
  * A response item.
  *
@@ -339,6 +408,8 @@ typedef struct {
     tf_resp_spv_error_t spv_error; ///< Response item details in case it's a SetParameterValues Error response.
     tf_resp_gpc_t       gpc;    ///< Response item details in case it's a GetParameterCount response.
     tf_resp_add_t       add;    ///< Response item details in case it's an AddObject response.
+    tf_resp_gpv_deleted_t gpv_deleted; ///< Response item details in case it's a Delta GetParameterValues deleted object.
+    tf_resp_gpv_token_t gpv_token; ///< Response item details in case it's a Delta GetParameterValues token.
   } u;
 } tf_resp_t;
 
@@ -35,6 +35,8 @@ local GPN_RESP, GPN_REQ, DEL_RESP, RESOLVE_REQ, RESOLVE_RESP, APPLY, ERROR
 local SUBSCRIBE_REQ, SUBSCRIBE_RESP, UNSUBSCRIBE_REQ, UNSUBSCRIBE_RESP
 local GPL_REQ, GPL_RESP, GPC_REQ, GPC_RESP
 local GPV_NO_ABORT_REQ, GPV_NO_ABORT_RESP
+local GPV_DELTA_REQ, GPV_DELTA_RESP, GPV_FILTER_REQ
+local METRICS_REQ, METRICS_RESP
 
 do
   GPV_REQ = msg.tags.GPV_REQ
@@ -61,10 +63,15 @@ do
   ERROR = msg.tags.ERROR
   GPV_NO_ABORT_REQ = msg.tags.GPV_NO_ABORT_REQ
   GPV_NO_ABORT_RESP = msg.tags.GPV_NO_ABORT_RESP
+  GPV_DELTA_REQ = msg.tags.GPV_DELTA_REQ
+  GPV_DELTA_RESP = msg.tags.GPV_DELTA_RESP
+  GPV_FILTER_REQ = msg.tags.GPV_FILTER_REQ
+  METRICS_REQ = msg.tags.METRICS_REQ
+  METRICS_RESP = msg.tags.METRICS_RESP
 end
 
-local select, ipairs, pairs, type =
-      select, ipairs, pairs, type
+local select, ipairs, pairs, type, pcall, concat =
+      select, ipairs, pairs, type, pcall, table.concat
 
 -- minimum number of sockets to keep in the socket pool
 local min_sks = 3
@@ -249,6 +256,132 @@ function M.get(uuid, first_arg, second_arg, ...)
   return results, errors
 end
 
+---
+-- Retrieve the values of the given datamodel location(s), filtered by Transformer.
+-- Pass it a table with one or more partial or exact paths, an optional table
+-- with the names of the parameters to retrieve and an optional filter
+-- expression like 'Active == "1"'. Only the getters of the parameters that are
+-- returned or needed by the filter are called.
+-- Returns array of tables with 'path', 'param', 'value' and 'type' fields
+-- or nil + error message + error code.
+function M.getFiltered(uuid, paths, params, filter)
+  if uuid == nil or uuid == "" then
+    return nil, "no UUID", fault.INVALID_ARGUMENTS
+  end
+  if type(paths) ~= "table" or #paths == 0 then
+    return nil, "no data", fault.INVALID_ARGUMENTS
+  end
+  if params and type(params) ~= "table" then
+    return nil, "not table argument", fault.INVALID_ARGUMENTS
+  end
+  msg:init_encode(GPV_FILTER_REQ, max_size, uuid)
+  if not encode_path(filter or "") or not encode_path(concat(params or {}, ",")) then
+    return nil, "not string argument", fault.INVALID_ARGUMENTS
+  end
+  for _, path in ipairs(paths) do
+    if not encode_path(path) then
+      return nil, "not string argument", fault.INVALID_ARGUMENTS
+    end
+  end
+  msg:mark_last()
+  -- send the request
+  local sk, errmsg = send_on_sk(msg:retrieve_data())
+  if not sk then
+    return nil, errmsg, fault.INTERNAL_ERROR
+  end
+  -- process the response
+  local results = {}
+  local is_last = false
+  while not is_last do
+    local tag, resp
+    local data = sk:recv()
+    tag, is_last = msg:init_decode(data)
+    if tag == GPV_RESP then
+      resp = msg:decode()
+      for _, value in ipairs(resp) do
+        value.value = taint(value.value)
+        results[#results + 1] = value
+      end
+    elseif tag == ERROR then
+      resp = msg:decode()
+      release_sk(sk)
+      return nil, resp.errmsg, resp.errcode
+    else
+      release_sk(sk)
+      return nil, "invalid response type", fault.INTERNAL_ERROR
+    end
+  end
+  release_sk(sk)
+  return results
+end
+
+---
+-- Retrieve the values of the given datamodel location(s) that changed since
+-- an earlier call.
+-- Pass it the change token returned by that earlier call (or nil to retrieve
+-- all values) followed by one or more strings, each either a partial or
+-- exact path.
+-- Returns an array of tables with 'path', 'param', 'value' and 'type' fields
+-- for the changed parameters, an array with the paths of the objects that
+-- were deleted, the new change token and a boolean that is true if all
+-- values were returned because the given token was unknown or expired.
+-- If an error occurs nil + error message + error code is returned.
+function M.getDelta(uuid, token, ...)
+  if uuid == nil or uuid == "" then
+    return nil, "no UUID", fault.INVALID_ARGUMENTS
+  end
+  if select('#', ...) == 0 then
+    return nil, "no data", fault.INVALID_ARGUMENTS
+  end
+  msg:init_encode(GPV_DELTA_REQ, max_size, uuid)
+  if not encode_path(token or "") then
+    return nil, "not string argument", fault.INVALID_ARGUMENTS
+  end
+  for _, path in ipairs({...}) do
+    if not encode_path(path) then
+      return nil, "not string argument", fault.INVALID_ARGUMENTS
+    end
+  end
+  msg:mark_last()
+  -- send the request
+  local sk, errmsg = send_on_sk(msg:retrieve_data())
+  if not sk then
+    return nil, errmsg, fault.INTERNAL_ERROR
+  end
+  -- process the response
+  local results = {}
+  local deleted = {}
+  local new_token, full
+  local is_last = false
+  while not is_last do
+    local tag, resp
+    local data = sk:recv()
+    tag, is_last = msg:init_decode(data)
+    if tag == GPV_DELTA_RESP then
+      resp = msg:decode()
+      for _, record in ipairs(resp) do
+        if record.deleted then
+          deleted[#deleted + 1] = record.deleted
+        elseif record.token then
+          new_token, full = record.token, record.full
+        else
+          record.value = taint(record.value)
+          results[#results + 1] = record
+        end
+      end
+    elseif tag == ERROR then
+      resp = msg:decode()
+      release_sk(sk)
+      return nil, resp.errmsg, resp.errcode
+    else
+      release_sk(sk)
+      return nil, "invalid response type", fault.INTERNAL_ERROR
+    end
+  end
+  release_sk(sk)
+  return results, deleted, new_token, full
+end
+
 ---
 -- Retrieve the parameter names of the given datamodel location.
 -- Pass it one string representing either a partial or an exact 
@@ -518,17 +651,18 @@ function M.apply(uuid)
   return true
 end
 
-function M.subscribe(uuid, path, address, subtype, options)
+function M.subscribe(uuid, path, address, subtype, options, min_interval)
   if uuid == nil or uuid == "" then
     return nil, "no UUID"
   end
   if type(uuid) ~= "string" or type(path) ~= "string" or type(address) ~= "string" 
     or type(subtype) ~= "number" or subtype < 0 or subtype > 7 
-    or type(options) ~= "number" then
+    or type(options) ~= "number"
+    or (min_interval ~= nil and (type(min_interval) ~= "number" or min_interval < 0 or min_interval > 65535)) then
     return nil, "invalid argument"
   end
   msg:init_encode(SUBSCRIBE_REQ, max_size, uuid)
-  msg:encode(path, address, subtype, options)
+  msg:encode(path, address, subtype, options, min_interval)
   msg:mark_last()
   -- send the request
   local sk, errmsg = send_on_sk(msg:retrieve_data())
@@ -677,4 +811,57 @@ function M.getPC(uuid, ...)
   return nil, "invalid response type"
 end
 
+---
+-- Retrieve the measurements of Transformer.
+-- Pass it true to clear the measurements after retrieving them.
+-- Returns an array of tables with 'group', 'name' and 'count' fields; the
+-- measured durations also have 'total' and 'max' fields in microseconds and
+-- a 'buckets' array with the number of durations up to 100us, 1ms, 10ms,
+-- 100ms, 1s and above, or nil + error message.
+function M.getMetrics(uuid, reset)
+  if uuid == nil or uuid == "" then
+    return nil, "no UUID"
+  end
+  msg:init_encode(METRICS_REQ, max_size, uuid)
+  msg:encode(reset)
+  msg:mark_last()
+  -- send the request
+  local sk, errmsg = send_on_sk(msg:retrieve_data())
+  if not sk then
+    return nil, errmsg
+  end
+  -- process the response
+  local results = {}
+  local is_last = false
+  local decode_err
+  while not is_last do
+    local tag, resp, ok
+    local data = sk:recv()
+    tag, is_last = msg:init_decode(data)
+    if tag == METRICS_RESP then
+      -- keep reading the remaining datagrams after a decode error
+      ok, resp = pcall(msg.decode, msg)
+      if not ok then
+        decode_err = decode_err or resp
+      elseif not decode_err then
+        for _, m in ipairs(resp) do
+          results[#results + 1] = m
+        end
+      end
+    elseif tag == ERROR then
+      resp = msg:decode()
+      release_sk(sk)
+      return nil, resp.errmsg
+    else
+      release_sk(sk)
+      return nil, "invalid response type"
+    end
+  end
+  release_sk(sk)
+  if decode_err then
+    return nil, decode_err
+  end
+  return results
+end
+
 return M
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2016 Technicolor Delivery Technologies, SAS
+ *
+ * The source code form of this Transformer component is subject
+ * to the terms of the Clear BSD license.
+ *
+ * You can redistribute it and/or modify it under the terms of the
+ * Clear BSD License (http://directory.fsf.org/wiki/License:ClearBSD)
+ *
+ * See LICENSE file for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+static int push_error(lua_State *L, const char *path, int err)
+{
+  lua_pushnil(L);
+  lua_pushfstring(L, "%s: %s", path, strerror(err));
+  return 2;
+}
+
+/* fsync(path): flush the data of the given file or directory to storage.
+ * Syncing a directory makes the renames and removals in it durable.
+ * Returns true or nil + error message.
+ */
+static int luaT_fsync(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  int fd;
+  int rc;
+
+  do {
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  } while (fd < 0 && errno == EINTR);
+  if (fd < 0) {
+    return push_error(L, path, errno);
+  }
+  rc = fsync(fd);
+  if (rc < 0) {
+    int err = errno;
+    close(fd);
+    return push_error(L, path, err);
+  }
+  if (close(fd) < 0 && errno != EINTR) {
+    return push_error(L, path, errno);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* private_dir(path): make sure the given directory can only be changed by
+ * the current user. It's created with mode 0700 if it doesn't exist yet.
+ * An existing one must be a directory (not a symlink) owned by the current
+ * user and not writable by group or others.
+ * Returns true or nil + error message.
+ */
+static int luaT_private_dir(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  struct stat st;
+
+  if (mkdir(path, S_IRWXU) < 0 && errno != EEXIST) {
+    return push_error(L, path, errno);
+  }
+  if (lstat(path, &st) < 0) {
+    return push_error(L, path, errno);
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return push_error(L, path, ENOTDIR);
+  }
+  if (st.st_uid != geteuid()) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: not owned by the current user", path);
+    return 2;
+  }
+  if (st.st_mode & (S_IWGRP | S_IWOTH)) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: writable by group or others", path);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+__attribute__((visibility("default")))
+int luaopen_lfsync (lua_State *L)
+{
+  static const luaL_reg liblua_tch_fsync [] = {
+      {"fsync",       luaT_fsync},
+      {"private_dir", luaT_private_dir},
+      {NULL, NULL}  /* sentinel */
+  };
+
+  lua_createtable(L, 0, sizeof(liblua_tch_fsync)/sizeof(*liblua_tch_fsync));
+  luaL_register(L, NULL, liblua_tch_fsync);
+  return 1;
+}
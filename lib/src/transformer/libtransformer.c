@@ -69,7 +69,15 @@ typedef enum {
   MSG_GPL_REQ,            // GetParameterList request
   MSG_GPL_RESP,           // GetParameterList response
   MSG_GPC_REQ,            // GetCount request
-  MSG_GPC_RESP            // GetCount response
+  MSG_GPC_RESP,           // GetCount response
+  MSG_GPV_NO_ABORT_REQ,   // GetParameterValues without abort request
+  MSG_GPV_NO_ABORT_RESP,  // GetParameterValues without abort response
+  MSG_EVENTS,             // Batched events
+  MSG_GPV_DELTA_REQ,      // Delta GetParameterValues request
+  MSG_GPV_DELTA_RESP,     // Delta GetParameterValues response
+  MSG_GPV_FILTER_REQ,     // Filtered GetParameterValues request
+  MSG_METRICS_REQ,        // Metrics request
+  MSG_METRICS_RESP        // Metrics response
 } tf_msgtype_e;
 
 struct tf_ctx_s {
@@ -365,6 +373,46 @@ tf_err_e tf_fill_request(tf_ctx_t* ctx, const tf_req_t* req)
         return TF_ERR_RES_EXCEEDED;
       }
       break;
+    case TF_REQ_GPV_DELTA:
+    {
+      if (!req->u.gpv_delta.path)
+      {
+        TF_LOG_ERR("no path provided");
+        return TF_ERR_INVALID_ARG;
+      }
+      // the token precedes the paths so it's only encoded for the first item
+      bool first = (ctx->msg_buffer[0] != MSG_GPV_DELTA_REQ);
+      check_msg_buffer(ctx, MSG_GPV_DELTA_REQ, false);
+      TF_LOG_DBG("GPV_DELTA: %s", req->u.gpv_delta.path);
+      if ((first && !encode_string(ctx, req->u.gpv_delta.token ? req->u.gpv_delta.token : "")) ||
+          !encode_string(ctx, req->u.gpv_delta.path))
+      {
+        // TODO: reset request? (see above)
+        return TF_ERR_RES_EXCEEDED;
+      }
+      break;
+    }
+    case TF_REQ_GPV_FILTER:
+    {
+      if (!req->u.gpv_filter.path)
+      {
+        TF_LOG_ERR("no path provided");
+        return TF_ERR_INVALID_ARG;
+      }
+      // the filter and parameter names precede the paths so they're only
+      // encoded for the first item
+      bool first = (ctx->msg_buffer[0] != MSG_GPV_FILTER_REQ);
+      check_msg_buffer(ctx, MSG_GPV_FILTER_REQ, false);
+      TF_LOG_DBG("GPV_FILTER: %s", req->u.gpv_filter.path);
+      if ((first && (!encode_string(ctx, req->u.gpv_filter.filter ? req->u.gpv_filter.filter : "") ||
+                     !encode_string(ctx, req->u.gpv_filter.params ? req->u.gpv_filter.params : ""))) ||
+          !encode_string(ctx, req->u.gpv_filter.path))
+      {
+        // TODO: reset request? (see above)
+        return TF_ERR_RES_EXCEEDED;
+      }
+      break;
+    }
     default:
       TF_LOG_ERR("invalid request type %d", req->type);
       return TF_ERR_INVALID_ARG;
@@ -448,6 +496,23 @@ static bool expect_response(tf_msgtype_e msgtype)
   return true;
 }
 
+static bool decode_byte(tf_ctx_t* ctx, uint8_t* by)
+{
+  if (ctx->msg_idx + sizeof(*by) > ctx->msg_bytes)
+  {
+    TF_LOG_ERR("trying to read beyond buffer: %zu > %zu", ctx->msg_idx + sizeof(*by), ctx->msg_bytes);
+    return false;
+  }
+  *by = ctx->msg_buffer[ctx->msg_idx];
+  if (ctx->tmp_byte_set)
+  {
+    *by = ctx->tmp_byte;
+    ctx->tmp_byte_set = false;
+  }
+  ctx->msg_idx += 1;
+  return true;
+}
+
 static bool decode_number(tf_ctx_t* ctx, uint16_t* number)
 {
   if (ctx->msg_idx + sizeof(*number) > ctx->msg_bytes)
@@ -466,6 +531,18 @@ static bool decode_number(tf_ctx_t* ctx, uint16_t* number)
   return true;
 }
 
+static bool decode_number32(tf_ctx_t* ctx, uint32_t* number)
+{
+  uint16_t hi, lo;
+
+  if (!decode_number(ctx, &hi) || !decode_number(ctx, &lo))
+  {
+    return false;
+  }
+  *number = (((uint32_t)hi) << 16) + lo;
+  return true;
+}
+
 static bool decode_string(tf_ctx_t* ctx, const char** str)
 {
   uint16_t s_len;
@@ -606,12 +683,45 @@ static bool decode_next_response(tf_ctx_t* ctx)
       break;
     case MSG_GPC_RESP:
       ctx->resp.type = TF_RESP_GPC;
-      rc = decode_number(ctx, &ctx->resp.u.gpc.count);
+      rc = decode_number32(ctx, &ctx->resp.u.gpc.count);
       break;
     case MSG_ADD_RESP:
       ctx->resp.type = TF_RESP_ADD;
       rc = decode_string(ctx, &ctx->resp.u.add.instance);
       break;
+    case MSG_GPV_DELTA_RESP:
+    {
+      // every record starts with its kind: a value, a deleted object or the token
+      uint8_t kind = 0;
+      if (!decode_byte(ctx, &kind))
+      {
+        break;
+      }
+      if (kind == 0)
+      {
+        const char* s_ptype = NULL;
+        ctx->resp.type = TF_RESP_GPV;
+        rc = decode_string(ctx, &ctx->resp.u.gpv.partial_path) &&
+             decode_string(ctx, &ctx->resp.u.gpv.param) &&
+             decode_string(ctx, &ctx->resp.u.gpv.value) &&
+             decode_string(ctx, &s_ptype) &&
+             s_ptype2ptype(s_ptype, &ctx->resp.u.gpv.ptype);
+      }
+      else if (kind == 1)
+      {
+        ctx->resp.type = TF_RESP_GPV_DELETED;
+        rc = decode_string(ctx, &ctx->resp.u.gpv_deleted.partial_path);
+      }
+      else
+      {
+        uint8_t full = 0;
+        ctx->resp.type = TF_RESP_GPV_TOKEN;
+        rc = decode_string(ctx, &ctx->resp.u.gpv_token.token) &&
+             decode_byte(ctx, &full);
+        ctx->resp.u.gpv_token.full = (full == 1);
+      }
+      break;
+    }
     default:
       TF_LOG_ERR("unknown response type %d", ctx->msg_buffer[0]);
       return false;
@@ -0,0 +1,81 @@
+#!/usr/bin/env lua
+--[[
+Copyright (c) 2017 Technicolor Delivery Technologies, SAS
+
+The source code form of this Transformer component is subject
+to the terms of the Clear BSD license.
+
+You can redistribute it and/or modify it under the terms of the
+Clear BSD License (http://directory.fsf.org/wiki/License:ClearBSD)
+
+See LICENSE file for more details.
+]]
+
+-- Measure how long the first sync of a big multi instance table takes for
+-- each database profile, followed by a sync where nothing changed.
+-- This script must be called from the root of the repo:
+--   lua scripts/bench_sync.lua [dbdir] [instances]
+-- Point dbdir to the storage you want to measure (e.g. a directory on flash);
+-- it defaults to /tmp. The number of instances defaults to 1000.
+
+package.path = "./?.lua;" .. package.path
+
+local format = string.format
+local persistency = require("transformer.persistency")
+local db = require("transformer.persistency.db")
+
+local dbdir = arg[1] or "/tmp"
+local instances = tonumber(arg[2]) or 1000
+local dbname = "bench_sync.db"
+
+-- Prefer a wall clock so the time spent waiting on fsync is included.
+local now = os.clock
+local ok, posix = pcall(require, "tch.posix")
+if ok and posix.clock_gettime and posix.CLOCK_MONOTONIC then
+  now = function()
+    local sec, nsec = posix.clock_gettime(posix.CLOCK_MONOTONIC)
+    return sec + nsec / 1e9
+  end
+else
+  print("warning: no monotonic clock available; reporting CPU time")
+end
+
+local function remove_db()
+  local path = format("%s/%s", dbdir, dbname)
+  os.remove(path)
+  os.remove(path .. "-wal")
+  os.remove(path .. "-shm")
+end
+
+local keys = {}
+for i = 1, instances do
+  keys[i] = format("host%d", i)
+end
+
+local function timed_sync(p, tp_id)
+  local start = now()
+  p:startTransaction()
+  p:sync(tp_id, keys, {})
+  p:commitTransaction()
+  return now() - start
+end
+
+local profiles = {}
+for name in pairs(db.profiles) do
+  profiles[#profiles + 1] = name
+end
+table.sort(profiles)
+
+print(format("%d instances in %s", instances, dbdir))
+for _, profile in ipairs(profiles) do
+  remove_db()
+  local p = persistency.new(dbdir, dbname, profile)
+  p:startTransaction()
+  local tp_id = p:addTypePath("Device.Hosts.Host.{i}.")
+  p:commitTransaction()
+  local first = timed_sync(p, tp_id)
+  local again = timed_sync(p, tp_id)
+  p:close()
+  print(format("%-12s first sync %8.3f ms, unchanged sync %8.3f ms", profile, first * 1000, again * 1000))
+end
+remove_db()
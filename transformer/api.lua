@@ -10,11 +10,17 @@ Clear BSD License (http://directory.fsf.org/wiki/License:ClearBSD)
 See LICENSE file for more details.
 ]]
 
-local require, pcall, tostring, setmetatable, type, ipairs =
-      require, pcall, tostring, setmetatable, type, ipairs
+local require, pcall, tostring, setmetatable, type, ipairs, select =
+      require, pcall, tostring, setmetatable, type, ipairs, select
+local match, find, sub = string.match, string.find, string.sub
 
+local logger = require 'tch.logger'
 local fault = require 'transformer.fault'
 local xref = require 'transformer.xref'
+local compile_filter = require('transformer.navigation').compile_filter
+local tracer = require 'transformer.tracer'
+local ucihelper = require 'transformer.mapper.ucihelper'
+local now = require('transformer.metrics').now
 
 -- Methods available on a Transformer context.
 local Transformer = {}
@@ -48,13 +54,32 @@ end
 -- an error if anything goes wrong.
 -- This function should be pcall()'d.
 local function commit(self, uuid)
-  self.store:commit(uuid)
+  -- Every mapping commits its own changes; the generic UCI mappers write
+  -- each UCI config only once, after all mappings committed but before the
+  -- events are sent and the commit & apply actions run.
+  ucihelper.defer_commits()
+  local rc, ok, errmsg = pcall(self.store.commit, self.store, uuid, ucihelper.flush_commits)
+  -- nothing is deferred anymore after this, also if the store didn't get
+  -- to flushing
+  local flushed, flush_errmsg = ucihelper.flush_commits()
+  if not rc then
+    error(ok, 0)
+  end
+  if not ok or not flushed then
+    fault.InternalError("%s", errmsg or flush_errmsg)
+  end
   self.commitapply:commitTransaction()
   return true
 end
 
 --- Wrapper around the commit functionality.
 local function commitTransaction(self, uuid)
+  if tracer.active then
+    local start = now()
+    local rc, errcode, errmsg = do_pcall(commit, self, uuid)
+    tracer.span("commit", "commit", start)
+    return rc, errcode, errmsg
+  end
   return do_pcall(commit, self, uuid)
 end
 
@@ -89,7 +114,10 @@ local function do_transaction_pcall(func, self, uuid, ...)
   if not res and errcode then
     revertTransaction(self, uuid)
   else
-    commitTransaction(self, uuid)
+    local ok, commit_errcode, commit_errmsg = commitTransaction(self, uuid)
+    if not ok then
+      return nil, commit_errcode, commit_errmsg
+    end
   end
   return res, errcode, errmsg
 end
@@ -182,6 +210,7 @@ local function get(self, uuid, no_abort_on_error, paths, cb)
   local store = self.store
   local navigate = store.navigate
   for _, path in ipairs(paths) do
+    local start = tracer.active and now()
     if no_abort_on_error then
       get_without_abort(uuid, store, navigate, path, cb)
     else
@@ -191,6 +220,9 @@ local function get(self, uuid, no_abort_on_error, paths, cb)
         end
       end
     end
+    if start then
+      tracer.span("navigate", path, start)
+    end
   end
   return true
 end
@@ -219,6 +251,220 @@ function Transformer:getParameterValues(uuid, no_abort_on_error, paths, cb)
   return do_transaction_pcall(get, self, uuid, no_abort_on_error, paths, cb)
 end
 
+--- The changes a delta get must take into account.
+-- The set is built from the change journal of the eventhor and is brought
+-- up to date during the get, since the get itself can find instances that
+-- were added or deleted when it synchronizes the mappings.
+-- @return The change set or nil if the token is not (or no longer) known.
+local function new_change_set(eventhor, token)
+  local changes, seq = eventhor:changesSince(token)
+  if not changes then
+    return nil
+  end
+  local set = {
+    eventhor = eventhor,
+    epoch = match(token, "^(.*%-)"),
+    seq = seq,
+    params = {},   -- parameter paths that were set
+    objects = {},  -- object paths that were added, deleted or changed as a whole
+    deleted = {},  -- object paths that were deleted, in order
+    late = {},     -- parameter paths that were set during the get
+  }
+  return set, changes
+end
+
+local function add_changes(set, changes, late)
+  local params, objects, deleted = set.params, set.objects, set.deleted
+  for _, change in ipairs(changes) do
+    local path, operation = change.path, change.operation
+    if sub(path, -1) ~= "." then
+      params[path] = true
+      if late then
+        late[#late + 1] = path
+      end
+    else
+      objects[path] = true
+      if operation == "delete" then
+        if not deleted[path] then
+          deleted[#deleted + 1] = path
+          deleted[path] = #deleted
+        end
+      elseif operation == "add" and deleted[path] then
+        -- the object is back; its values are reported instead
+        deleted[deleted[path]] = false
+        deleted[path] = nil
+      end
+    end
+  end
+end
+
+--- Bring the change set up to date with the journal.
+-- If the journal overflowed in the meantime all changes are assumed.
+local function refresh_changes(set)
+  if set.expired then
+    return
+  end
+  local changes, seq = set.eventhor:changesSince(set.epoch .. set.seq)
+  if not changes then
+    set.expired = true
+    return
+  end
+  set.seq = seq
+  add_changes(set, changes, set.late)
+end
+
+--- Check whether a path is one of the requested paths or below one of them.
+local function is_requested(paths, path)
+  for _, requested in ipairs(paths) do
+    if sub(path, 1, #requested) == requested then
+      return true
+    end
+  end
+  return false
+end
+
+--- Check whether the given object path or one of its ancestors is in a set.
+local function in_path_set(paths, objpath)
+  local pos = find(objpath, ".", 1, true)
+  while pos do
+    if paths[sub(objpath, 1, pos)] then
+      return true
+    end
+    pos = find(objpath, ".", pos + 1, true)
+  end
+  return false
+end
+
+--- Check whether the given object or one of its ancestors changed as a whole.
+local function object_changed(set, eventpath)
+  return set.expired or in_path_set(set.objects, eventpath)
+end
+
+-- Do the actual filtered 'get'; throw error if anything goes wrong.
+-- This function should be pcall()'d
+local function get_filtered(self, uuid, paths, projection, filter, cb)
+  local store = self.store
+  local navigate = store.navigate
+  if filter then
+    filter = compile_filter(filter)
+  end
+  for _, path in ipairs(paths) do
+    local start = tracer.active and now()
+    -- objects that don't match the filter are skipped by the navigation,
+    -- together with their children
+    for obj in navigate(store, uuid, path, "getlist", nil, filter) do
+      -- without a projection all values are needed so getall() is used
+      for param in obj:params(not projection, projection) do
+        call_cb(cb, param:get())
+      end
+    end
+    if start then
+      tracer.span("navigate", path, start)
+    end
+  end
+  return true
+end
+
+--- Retrieve the parameter values of the given paths, filtered on the server.
+-- The getters of parameters that are not needed are not called.
+-- @param uuid Identifier of the requester
+-- @param paths Array of exact or partial paths to retrieve.
+-- @param projection (optional) Array of parameter names; only those parameters
+--   are returned for the objects of partial paths.
+-- @param filter (optional) A filter expression like `Active == "1"`; clauses can be
+--   joined with `and`. Objects that have the parameters of the filter but don't
+--   match it are skipped together with their children. Other objects are
+--   not filtered.
+-- @param cb Callback function that will be invoked for each parameter,
+--   with the same arguments as for getParameterValues().
+-- @return true or nil, errorcode, errormsg
+function Transformer:getFilteredParameterValues(uuid, paths, projection, filter, cb)
+  if projection and #projection == 0 then
+    projection = nil
+  end
+  if filter == "" then
+    filter = nil
+  end
+  return do_transaction_pcall(get_filtered, self, uuid, paths, projection, filter, cb)
+end
+
+-- Do the actual delta 'get'; throw error if anything goes wrong.
+-- This function should be pcall()'d
+local function get_delta(self, uuid, token, paths, cb, deleted_cb)
+  local eventhor = self.eventhor
+  local set, changes
+  if token and token ~= "" then
+    set, changes = new_change_set(eventhor, token)
+  end
+  if not set then
+    -- Unknown or expired token; everything is reported.
+    get(self, uuid, false, paths, cb)
+    return eventhor:changeToken(), true
+  end
+  add_changes(set, changes)
+  local store = self.store
+  local navigate = store.navigate
+  for _, path in ipairs(paths) do
+    local start = tracer.active and now()
+    for obj in navigate(store, uuid, path, "getlist") do
+      refresh_changes(set)
+      local eventpath = obj:getEventPath()
+      local all = not obj:isEvented() or object_changed(set, eventpath)
+      local params = set.params
+      for param in obj:params(all) do
+        if all or not param:isEvented() or params[eventpath .. select(2, param:getName())] then
+          call_cb(cb, param:get())
+        end
+      end
+    end
+    if start then
+      tracer.span("navigate", path, start)
+    end
+  end
+  refresh_changes(set)
+  -- Synchronizing a mapping changes the number of entries parameter of
+  -- its parent, which may have been visited already.
+  for _, path in ipairs(set.late) do
+    if is_requested(paths, path) then
+      for obj in navigate(store, uuid, path, "getlist") do
+        for param in obj:params() do
+          call_cb(cb, param:get())
+        end
+      end
+    end
+  end
+  for _, path in ipairs(set.deleted) do
+    if path and is_requested(paths, path) then
+      call_cb(deleted_cb, path)
+    end
+  end
+  if set.expired then
+    -- Some deletions may have been missed; let the next request be a full one.
+    return "", false
+  end
+  return eventhor:changeToken(), false
+end
+
+--- Retrieve the parameter values that changed since a change token was handed out.
+-- Only parameters of which the mapping reports its changes through events are
+-- filtered; the others are always reported.
+-- @param uuid Identifier of the requester
+-- @param token The change token returned by an earlier call, or nil or an empty
+--   string to retrieve all values.
+-- @param paths Array of exact or partial paths to retrieve.
+-- @param cb Callback function that will be invoked for each changed parameter,
+--   with the same arguments as for getParameterValues().
+-- @param deleted_cb Callback function that will be invoked with the path of
+--   every object below the requested paths that was deleted since then.
+-- @return token, full or nil, errorcode, errormsg
+--   The token identifies the state after this request. `full` is true if the
+--   given token was unknown or expired and all values were reported; the
+--   client should then drop whatever it knew. An empty token means no token
+--   could be handed out and the next request will report all values.
+function Transformer:getParameterValuesDelta(uuid, token, paths, cb, deleted_cb)
+  return do_transaction_pcall(get_delta, self, uuid, token, paths, cb, deleted_cb)
+end
+
 -- Do the actual 'get list'; throw error if anything goes wrong.
 -- This function should be pcall()'d
 local function getParams(self, uuid, path, cb)
@@ -247,16 +493,11 @@ function Transformer:getParameterList(uuid, path, cb)
 end
 
 -- the actual get count.
--- This does a getlist (so no values need to be retrieved) and just counts
--- the number of parameters returned.
+-- The count is derived from the number of parameters of each type and the
+-- instances known in the database, so no parameter is visited and only the
+-- instances of the requested path itself are synchronized.
 local function getcount(self, uuid, path)
-  local count = 0
-    for obj in self.store:navigate(uuid, path, "getlist") do
-        for _ in obj:params() do
-          count = count + 1
-        end
-    end
-    return count
+  return self.store:count(uuid, path)
 end
 
 --- Retrieve the number of parameters for the given path.
@@ -311,11 +552,15 @@ function Transformer:getParameterNames(uuid, path, level, cb)
 end
 
 local function set(self, uuid, path, value)
+    local start = tracer.active and now()
     for obj in self.store:navigate(uuid, path, "set") do
         for param in obj:params() do
             param:set(value)
         end
     end
+    if start then
+      tracer.span("navigate", path, start)
+    end
     return true
 end
 
@@ -358,11 +603,18 @@ function Transformer:setParameterValues(uuid, setValues)
         end
     end
     if errors and #errors ~= 0 then
-      -- TODO what to do if commit or revert fails? SPV is currently not able to
+      -- TODO what to do if revert fails? SPV is currently not able to
       -- return an error?
       revertTransaction(self, uuid)
     else
-      commitTransaction(self, uuid)
+      -- when the changes couldn't be committed none of the sets took effect
+      local ok, errcode, errmsg = commitTransaction(self, uuid)
+      if not ok then
+        errors = {}
+        for _, pv in ipairs(setValues) do
+          errors[#errors+1] = {pv.path, errcode, errmsg}
+        end
+      end
     end
     return errors==nil, errors
 end
@@ -450,9 +702,18 @@ function Transformer:tokey(uuid, objectPath)
     return rc, errcode, errmsg
 end
 
-function Transformer:subscribe(uuid, path, addr, subscr_type, options)
+--- Save the database to its persistent location if it runs on a working copy.
+-- Must be called outside of any request processing.
+-- @return true or nil, errorcode, errormsg
+function Transformer:checkpoint()
+  local persistency = self.store.persistency
+  return do_pcall(persistency.checkpoint, persistency)
+end
+
+function Transformer:subscribe(uuid, path, addr, subscr_type, options, min_interval)
   local eventhor = self.eventhor
-  local rc, errcode, errmsg = do_pcall(eventhor.addSubscription, eventhor, uuid, path, addr, subscr_type, options)
+  local rc, errcode, errmsg = do_pcall(eventhor.addSubscription, eventhor, uuid, path, addr, subscr_type, options,
+                                       min_interval)
   return rc, errcode, errmsg
 end
 
@@ -462,15 +723,47 @@ function Transformer:unsubscribe(uuid, subscr_id)
   return rc, errcode, errmsg
 end
 
+--- Set the function used to postpone the delivery of events to
+-- subscriptions that have a minimum interval.
+-- @param schedule A function taking a callback and a delay in milliseconds.
+function Transformer:setEventScheduler(schedule)
+  self.eventhor:setScheduler(schedule)
+end
+
+--- Set the function used to wait until a subscriber socket can take
+-- queued events again.
+-- @param watch A function taking a file descriptor and a callback that
+--   returns an object with a `delete()` method.
+function Transformer:setEventWriteWatcher(watch)
+  self.eventhor:setWriteWatcher(watch)
+end
+
+--- Retrieve the event delivery statistics per subscriber address.
+-- @return A table with per address the number of queued, sent and
+--   dropped event datagrams.
+function Transformer:eventStats()
+  return self.eventhor:subscriberStats()
+end
+
+--- Retrieve the statistics on lazily loaded map files.
+-- @return A table with the number of deferred map files, how many of them
+--   are loaded by now and the estimated heap (in KiB) the others still save.
+function Transformer:lazyStats()
+  return self.store:lazyStats()
+end
+
 local M = {}
 
 local function init(config)
   local store = require("transformer.typestore").new(config.persistency_location,
-                                                     config.persistency_name)
+                                                     config.persistency_name,
+                                                     config.persistency_profile,
+                                                     config.persistency_workdir)
   local self = {
     store = store,
     commitapply = require("transformer.commitapply").new(config.commitpath),
-    eventhor = require("transformer.eventhor").new(store),
+    eventhor = require("transformer.eventhor").new(store, config.event_queue_size, config.event_overflow,
+                                                   config.change_journal_size),
   }
   return setmetatable(self, Transformer)
 end
@@ -484,9 +777,34 @@ end
 --                           (e.g. instance numbers and their relation to keys)
 --     persistency_name : (optional) the name of the database file, defaults to
 --                        transformer.db
+--     persistency_profile : (optional) the database tuning profile; either the name
+--                           of a predefined profile or a table with PRAGMA values.
+--                           See transformer.persistency.db for details.
+--     persistency_workdir : (optional) directory (typically on tmpfs) in which the
+--                           database is used; it is only copied to persistency_location
+--                           when checkpoint() is called.
+--     event_queue_size : (optional) maximum number of event datagrams queued for
+--                        a subscriber that doesn't keep up.
+--     event_overflow : (optional) what to do when such a queue is full; "drop_oldest"
+--                      (default) or "resync".
+--     change_journal_size : (optional) number of changes remembered for delta
+--                           parameter retrieval.
 --     ignore_patterns : (optional) A table of patterns for typepaths that need to be ignored.
 --     vendor_patterns : (optional) A table of patterns of vendor extensions for paths that should be allowed.
 --     unhide_patterns : (optional) A table of patterns for typepaths that must not be hidden.
+--     mapcache : (optional) location of the map snapshot file. When given, the outcome
+--                of loading the maps is stored there and reused on the next start
+--                if the maps didn't change. The compiled map files are kept in a
+--                directory next to it (with a '.d' suffix); it's only used when
+--                no one but Transformer's user can write in it.
+--     lazy_maps : (optional) if true and the map snapshot is up to date, map files are
+--                 only loaded the first time a request touches their part of the datamodel.
+--                 A map file is still loaded at startup when the UCI configs or files it
+--                 read while registering its mappings changed since the snapshot was saved.
+--                 Only UCI reads through mapper("ucihelper") and files read with io.open()
+--                 or io.lines() are tracked; a map file that decides what to register from
+--                 other inputs (e.g. require("uci") or io.popen()) is deferred with the
+--                 typepaths it registered before.
 -- @return An object on which you can call various methods or nil + error
 --         message if something went wrong.
 function M.init(config)
@@ -508,13 +826,31 @@ function M.init(config)
     -- split config.mappath on : separators and load the maps in each of them
     -- TODO: move this into mapload.load_all_maps so we can reuse the map env
     local mapload = require("transformer.mapload")
+    local mappaths = {}
     for path in config.mappath:gmatch("([^:]+)") do
-        local rc, err = mapload.load_all_maps(self.store, self.commitapply, path, config.ignore_patterns, config.vendor_patterns, config.unhide_patterns)
+        mappaths[#mappaths + 1] = path
+    end
+    local snapshot
+    if config.mapcache then
+        snapshot = mapload.open_snapshot(self.store, config.mapcache, mappaths, config.ignore_patterns, config.vendor_patterns, config.unhide_patterns, config.lazy_maps)
+    end
+    for _, path in ipairs(mappaths) do
+        local rc, err = mapload.load_all_maps(self.store, self.commitapply, path, config.ignore_patterns, config.vendor_patterns, config.unhide_patterns, snapshot)
         if not rc then
             self:close()
             return nil, err
         end
     end
+    if snapshot then
+        local rc, err = mapload.save_snapshot(self.store, snapshot, mappaths, config.ignore_patterns, config.vendor_patterns, config.unhide_patterns)
+        if not rc then
+            logger:warning("failed to save map snapshot: %s", err)
+        end
+        local stats = self.store:lazyStats()
+        if stats.deferred > 0 then
+            logger:info("deferred loading %d map files (about %d KiB)", stats.deferred, stats.saved_kb)
+        end
+    end
     return self
 end
 
@@ -30,7 +30,8 @@ See LICENSE file for more details.
 local lfs = require("lfs")
 local type, setmetatable, error, pairs, ipairs =
       type, setmetatable, error, pairs, ipairs
-local find, match = string.find, string.match
+local find, match, sub = string.find, string.match, string.sub
+local concat = table.concat
 local open = io.open
 local logger = require("tch.logger")
 local execute = require("lasync").execute
@@ -38,6 +39,27 @@ local execute = require("lasync").execute
 local CommitApply = {}
 CommitApply.__index = CommitApply
 
+-- Queue an action, or each action of a set of actions.
+local function queue_action(queued_actions, action)
+  if type(action) == "table" then
+    for a in pairs(action) do
+      queued_actions[a] = true
+    end
+  else
+    queued_actions[action] = true
+  end
+end
+
+-- Queue the actions of the rules in 'list' that match 'path'.
+local function match_rules(queued_actions, path, list)
+  for i = 1, #list, 2 do
+    if match(path, list[i]) then
+--      logger:debug("rule match with %s", list[i])
+      queue_action(queued_actions, list[i + 1])
+    end
+  end
+end
+
 ---
 -- Inform the commit & apply context about a new 'set'
 -- operation on the given path.
@@ -53,18 +75,22 @@ function CommitApply:newset(path)
   else
     queued_actions = self.queued_actions
   end
-  for rule, action in pairs(self.rules) do
-    if match(path, rule) then
---      logger:debug("rule match with %s", rule)
-      if type(action) == "table" then
-        for a in pairs(action) do
-          queued_actions[a] = true
-        end
-      else
-        queued_actions[action] = true
-      end
+  -- Only the rules that can possibly match 'path' are tried; see compile_rules().
+  local matcher = self.matcher
+  local exact = matcher.exact[path]
+  if exact then
+    for i = 2, #exact, 2 do
+      queue_action(queued_actions, exact[i])
+    end
+  end
+  local dot = find(path, ".", 1, true)
+  if dot then
+    local list = matcher.per_config[sub(path, 1, dot - 1)]
+    if list then
+      match_rules(queued_actions, path, list)
     end
   end
+  match_rules(queued_actions, path, matcher.other)
 end
 
 ---
@@ -174,6 +200,76 @@ local function load_rule_file(file, rules)
   f:close()
 end
 
+--- Extract the literal text at the start of a pattern.
+-- Stops at the first character that isn't matched literally (a magic
+-- character, a character class or a character followed by a quantifier).
+-- @param pattern The pattern.
+-- @param i The position in the pattern to start from.
+-- @return The literal text and the position of the first character after it.
+local function literal_prefix(pattern, i)
+  local literal = {}
+  local n = #pattern
+  while i <= n do
+    local c = sub(pattern, i, i)
+    local next_i
+    if c == "%" then
+      c = sub(pattern, i + 1, i + 1)
+      if c == "" or find(c, "^%w") then
+        break  -- a character class
+      end
+      next_i = i + 2
+    elseif find(c, "^[%^%$%(%)%.%[%]%*%+%-%?]") then
+      break
+    else
+      next_i = i + 1
+    end
+    if find(sub(pattern, next_i, next_i), "^[%*%+%-%?]") then
+      break  -- the character is quantified
+    end
+    literal[#literal + 1] = c
+    i = next_i
+  end
+  return concat(literal), i
+end
+
+--- Compile the rules into a structure that allows finding the rules that
+-- can match a path without trying all of them:
+-- * `exact[path]` has the rules that only match one literal path.
+-- * `per_config[config]` has the rules anchored to a literal prefix that
+--   includes the config name (the part up to the first dot); only paths of
+--   that config can match them.
+-- * `other` has all remaining rules.
+-- The lists hold rule, action pairs.
+local function compile_rules(rules)
+  local matcher = { exact = {}, per_config = {}, other = {} }
+  for rule, action in pairs(rules) do
+    local list = matcher.other
+    if sub(rule, 1, 1) == "^" then
+      local prefix, rest = literal_prefix(rule, 2)
+      local dot = find(prefix, ".", 1, true)
+      if sub(rule, rest) == "$" then
+        list = matcher.exact[prefix]
+        if not list then
+          list = {}
+          matcher.exact[prefix] = list
+        end
+      elseif dot then
+        local config = sub(prefix, 1, dot - 1)
+        list = matcher.per_config[config]
+        if not list then
+          list = {}
+          matcher.per_config[config] = list
+        end
+      end
+    end
+    if list then
+      list[#list + 1] = rule
+      list[#list + 1] = action
+    end
+  end
+  return matcher
+end
+
 local M = {
   ---
   -- Create a new commit & apply context and load
@@ -190,7 +286,8 @@ local M = {
         load_rule_file(commitpath .. "/" .. file, rules)
       end
     end
-    return setmetatable({ rules = rules, queued_actions = {}, transaction_actions = {}, transaction = false }, CommitApply)
+    return setmetatable({ rules = rules, matcher = compile_rules(rules), queued_actions = {}, transaction_actions = {},
+                          transaction = false }, CommitApply)
   end
 }
 
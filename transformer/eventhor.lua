@@ -10,8 +10,11 @@ Clear BSD License (http://directory.fsf.org/wiki/License:ClearBSD)
 See LICENSE file for more details.
 ]]
 
-local setmetatable, require, ipairs, pairs, pcall, tostring = setmetatable, require, ipairs, pairs, pcall, tostring
-local floor = math.floor
+local setmetatable, require, ipairs, pairs, pcall, tostring, tonumber, next =
+      setmetatable, require, ipairs, pairs, pcall, tostring, tonumber, next
+local floor, random = math.floor, math.random
+local gmatch, match, format = string.gmatch, string.match, string.format
+local time = os.time
 
 local pathFinder = require("transformer.pathfinder")
 local fault = require("transformer.fault")
@@ -72,24 +75,270 @@ local function type_2mask(subscr_type)
 end
 
 local option_no_own_events = 1
+local option_batch_events = 8
 local function check_option(mask, option)
   return floor(mask / option) % 2 == 1
 end
 
---- Load the watchers.
-local function beginWatch(self)
+local known_ops = {"set","add","delete"}
+
+--- Subscription index.
+-- The subscriptions are stored in a prefix tree on the segments of their
+-- path. A node holds, per event type, the subscriptions on the path that
+-- leads to it: `any` has the subscriptions that want all events while
+-- `not_own[uuid]` has the ones of client `uuid` that don't want the events
+-- caused by that client itself.
+-- Finding the subscriptions for an event is a walk down the tree along the
+-- segments of the event path.
+local function new_index_node(parent, segment)
+  return { parent = parent, segment = segment, children = {}, ops = {}, count = 0 }
+end
+
+local function index_subscription(root, sub)
+  local node = root
+  for segment in gmatch(sub.path, "[^%.]+") do
+    local child = node.children[segment]
+    if not child then
+      child = new_index_node(node, segment)
+      node.children[segment] = child
+    end
+    node = child
+  end
+  local own = check_option(sub.options, option_no_own_events)
+  for _, op in ipairs(known_ops) do
+    if sub.type[op] then
+      local ops = node.ops[op]
+      if not ops then
+        ops = { any = {}, not_own = {} }
+        node.ops[op] = ops
+      end
+      local bucket = ops.any
+      if own then
+        bucket = ops.not_own[sub.uuid]
+        if not bucket then
+          bucket = {}
+          ops.not_own[sub.uuid] = bucket
+        end
+      end
+      bucket[sub.ID] = sub
+    end
+  end
+  node.count = node.count + 1
+  sub.node = node
+end
+
+local function unindex_subscription(sub)
+  local node = sub.node
+  for _, op in ipairs(known_ops) do
+    local ops = node.ops[op]
+    if ops then
+      ops.any[sub.ID] = nil
+      local bucket = ops.not_own[sub.uuid]
+      if bucket then
+        bucket[sub.ID] = nil
+        if not next(bucket) then
+          ops.not_own[sub.uuid] = nil
+        end
+      end
+    end
+  end
+  node.count = node.count - 1
+  -- prune the branch of the tree that no longer holds subscriptions
+  while node.parent and node.count == 0 and not next(node.children) do
+    node.parent.children[node.segment] = nil
+    node = node.parent
+  end
+  sub.node = nil
+end
+
+--- Outbound queues.
+-- Events are sent on non-blocking sockets. When a subscriber doesn't keep up
+-- the datagrams for its address are queued and sent once its socket becomes
+-- writable again. The queue is bounded; on overflow either the oldest
+-- datagram is dropped or, with the "resync" policy, the whole queue is
+-- replaced by a single resync event (event type 0 with subscription ID 0 and
+-- an empty path) so the subscriber knows to reread the state of all its
+-- subscriptions. Either way the queue never holds more than its bound.
+local default_queue_size = 64
+local overflow_policies = { drop_oldest = true, resync = true }
+
+local function new_outbox()
+  return { first = 1, last = 0, sent = 0, dropped = 0, resyncs = 0, max_queued = 0 }
+end
+
+local function outbox_length(box)
+  return box.last - box.first + 1
+end
+
+local function clear_outbox(box)
+  for i = box.first, box.last do
+    box[i] = nil
+  end
+  box.first = 1
+  box.last = 0
+end
+
+local function push_outbox(box, data)
+  local last = box.last + 1
+  box[last] = data
+  box.last = last
+  local queued = outbox_length(box)
+  if queued > box.max_queued then
+    box.max_queued = queued
+  end
+end
+
+local function stop_watching(box)
+  if box.watcher then
+    box.watcher:delete()
+    box.watcher = nil
+  end
+end
+
+--- The socket to an address is broken; drop it and everything queued for it.
+local function drop_socket(box, address, errmsg)
+  local sk = sockets[address]
+  if sk then
+    sk:close()
+    sockets[address] = nil
+  end
+  stop_watching(box)
+  box.dropped = box.dropped + outbox_length(box)
+  clear_outbox(box)
+  if errmsg then
+    logger:error("failed to send event: %s", errmsg)
+  end
+end
+
+--- Send as much of the queue of an address as the socket accepts.
+-- @return true if the queue is empty afterwards.
+local function flush_outbox(box, address)
+  local sk = sockets[address]
+  if not sk then
+    -- Socket creation failed. Drop the events.
+    drop_socket(box, address)
+    return true
+  end
+  while box.first <= box.last do
+    local first = box.first
+    local rc, errmsg = sk:send(box[first])
+    if not rc then
+      if errmsg == "WOULDBLOCK" then
+        return false
+      end
+      drop_socket(box, address, errmsg)
+      return true
+    end
+    box[first] = nil
+    box.first = first + 1
+    box.sent = box.sent + 1
+  end
+  stop_watching(box)
+  return true
+end
+
+--- Queue a datagram behind the ones already waiting for an address.
+local function enqueue(self, box, address, data)
+  if outbox_length(box) >= self.queue_size then
+    if self.overflow == "resync" then
+      box.dropped = box.dropped + outbox_length(box) + 1
+      box.resyncs = box.resyncs + 1
+      clear_outbox(box)
+      logger:warning("event queue for %s overflowed; sending a resync event", address)
+      msg:init_encode(tags.EVENT, max_size)
+      msg:encode(0, "", 0, "0")
+      msg:mark_last()
+      push_outbox(box, msg:retrieve_data())
+      return
+    end
+    box[box.first] = nil
+    box.first = box.first + 1
+    box.dropped = box.dropped + 1
+  end
+  push_outbox(box, data)
+  local watch = self.watch_writable
+  local sk = sockets[address]
+  if watch and sk and not box.watcher then
+    box.watcher = watch(sk:fd(), function()
+      flush_outbox(box, address)
+    end)
+  end
+end
+
+--- Send a datagram to the given address, or queue it if the subscriber
+-- can't take it right now.
+-- @return true if the datagram was sent or queued, false if the socket to
+--   the address is unusable.
+local function send_to(self, address, data)
+  local box = self.outboxes[address]
+  if not box then
+    box = new_outbox()
+    self.outboxes[address] = box
+  end
+  -- keep the order; whatever is still queued goes first
+  if box.first <= box.last and not flush_outbox(box, address) then
+    enqueue(self, box, address, data)
+    return true
+  end
+  local sk = sockets[address]
+  if not sk then
+    -- Socket creation failed. Drop event or retry?
+    box.dropped = box.dropped + 1
+    return false
+  end
+  local rc, errmsg = sk:send(data)
+  if rc then
+    box.sent = box.sent + 1
+    return true
+  end
+  if errmsg == "WOULDBLOCK" then
+    enqueue(self, box, address, data)
+    return true
+  end
+  box.dropped = box.dropped + 1
+  drop_socket(box, address, errmsg)
+  return false
+end
+
+--- Let a mapping add its event source watches.
+-- A mapping that has watches is marked as evented: changes to its
+-- parameters (except the canDeny ones) are reported through events.
+local function add_watchers(mapping)
+  if mapping.add_watchers then
+    mapping.evented = true
+    local rc, errmsg = pcall(mapping.add_watchers, mapping)
+    if not rc then
+      logger:warning("add_watchers() on mapping %s threw an error :%s", mapping.objectType.name, errmsg)
+    end
+    mapping.add_watchers = nil
+  end
+end
+
+--- Load the watchers, unless that was done already.
+local function start_watching(self)
+  if self.watching then
+    return
+  end
   -- We add the watchers of all the mappings, but this could be optimized
   -- to only start watching based on the datamodel root of the subscription.
   for _, mapping in ipairs(self.store.mappings) do
-    if mapping.add_watchers then
-      local rc, errmsg = pcall(mapping.add_watchers, mapping)
-      if not rc then
-        logger:warning("add_watchers() on mapping %s threw an error :%s", mapping.objectType.name, errmsg)
-      end
-      mapping.add_watchers = nil
-    end
+    add_watchers(mapping)
   end
   -- Now my watch begins. It shall not end until my death.
+  self.watching = true
+end
+
+--- Notify that mappings were loaded after startup.
+-- Once watching has begun their watches are added right away.
+-- @param #table mappings The list of all mappings in the store.
+-- @param #number first The index of the first new mapping in that list.
+function Eventhor:mappingsLoaded(mappings, first)
+  if not self.watching then
+    return
+  end
+  for i = first, #mappings do
+    add_watchers(mappings[i])
+  end
 end
 
 --- Retrieve canDeny parameters below the given instance path.
@@ -106,7 +355,16 @@ local function getCanDenies(self, uuid, path)
   return non_evented_expanded
 end
 
-function Eventhor:addSubscription(uuid, path, addr, subscr_mask, options)
+--- Add a subscription.
+-- @param uuid The UUID of the subscribing client.
+-- @param path The path to subscribe to.
+-- @param addr The address of the socket the events are sent to.
+-- @param subscr_mask The mask of event types to subscribe to.
+-- @param options The mask of subscription options.
+-- @param min_interval (optional) The minimum time in milliseconds between two
+--   deliveries of events to this subscription. Events generated in between are
+--   held back, with repeated (path, operation) pairs collapsed into one.
+function Eventhor:addSubscription(uuid, path, addr, subscr_mask, options, min_interval)
   -- Some sanity checks
   if not path or not addr or not subscr_mask or not options then
     fault.InternalError("Incorrect number of arguments for subscription.")
@@ -121,10 +379,7 @@ function Eventhor:addSubscription(uuid, path, addr, subscr_mask, options)
   local sublist = self.subscriptionlist
   -- Let the mappings add their event source watches lazily, when the
   -- first valid subscription is received.
-  if self.subscriptions_counter == 0 then
-    beginWatch(self)
-    beginWatch = nil
-  end
+  start_watching(self)
   self.subscriptions_counter = self.subscriptions_counter + 1
   local subscriptionID = self.subscriptions_counter
 
@@ -136,18 +391,15 @@ function Eventhor:addSubscription(uuid, path, addr, subscr_mask, options)
     options = options,
     uuid = uuid,
     addr = addr,
-    mapping = mapping,
+    batch = check_option(options, option_batch_events),
+    min_interval = min_interval or 0,
   }
 
   -- Add the subscription to the subscriptions list.
   sublist[subscriptionID] = sub
 
-  -- Add the subscription to the mapping.
-  if not mapping.subscriptions then
-    mapping.subscriptions = {}
-  end
-  local subscriptions = mapping.subscriptions
-  subscriptions[subscriptionID] = sub
+  -- Add the subscription to the index.
+  index_subscription(self.subscription_index, sub)
 
   -- 'path' can be a future path, which will cause navigate to fail. Catch the error.
   local rc, non_evented_expanded = pcall(getCanDenies, self, uuid, path)
@@ -170,34 +422,80 @@ function Eventhor:removeSubscription(uuid, subscriptionID)
   if subscription.uuid ~= uuid then
     fault.RequestDenied("Remove subscription id %s not allowed", subscriptionID)
   end
-  --Remove the subscription from the mapping
-  local subscriptions = subscription.mapping.subscriptions
-  if subscriptions then
-    subscriptions[subscriptionID] = nil
-  end
-  --Invalidate sublist entry
+  --Remove the subscription from the index
+  unindex_subscription(subscription)
+  --Invalidate sublist entry and drop its undelivered events
   sublist[subscriptionID] = nil
+  self.pending_subs[subscriptionID] = nil
+  --Forget the outbound queue if nothing else is sent to that address
+  local address = subscription.addr
+  local box = self.outboxes[address]
+  if box then
+    for _, sub in pairs(sublist) do
+      if sub.addr == address then
+        return true
+      end
+    end
+    stop_watching(box)
+    self.outboxes[address] = nil
+  end
   return true
 end
 
-local function queue_single_event(self, uuid, mappings, path, operation)
+local function queue_subscriptions(event_queue, subscriptions, path, operation)
+  for id, sub in pairs(subscriptions) do
+    -- Duplicates are possible (one request can contain multiple sets that
+    -- trigger the same event); they are coalesced when firing.
+    logger:debug("queuing event for subscription (%d) with op %s from %s (path=%s) for uuid %s", id, operation, sub.path, path, sub.uuid)
+    event_queue[#event_queue + 1] = { id = id, path = path, operation = operation}
+  end
+end
+
+--- Change journal.
+-- Every change that goes through the event queue (the tracked changes of
+-- set, add and delete requests and the changes reported by the event
+-- sources) is also appended to a ring buffer of the last `size` changes,
+-- numbered with an increasing sequence number. A change token names the
+-- journal (its epoch, which differs after every restart) and a sequence
+-- number, so a client can ask which paths changed after it was handed out.
+-- The journal only starts recording once the first token is asked for.
+local default_journal_size = 1024
+
+local function new_journal(size)
+  return { seq = 0, size = size, paths = {}, ops = {} }
+end
+
+local function record_change(self, path, operation)
+  local journal = self.journal
+  if not journal.active then
+    return
+  end
+  local seq = journal.seq + 1
+  local slot = seq % journal.size + 1
+  journal.paths[slot] = path
+  journal.ops[slot] = operation
+  journal.seq = seq
+end
+
+local function queue_single_event(self, uuid, path, operation)
+  record_change(self, path, operation)
   uuid = uuid or self.store:clientUUID()
   local event_queue = self.event_queue
-  for _, mapping in ipairs(mappings) do
-    local subscriptions = mapping.subscriptions
-    if subscriptions then
-      for id, sub in pairs(subscriptions) do
-        logger:debug("    subscription on %s", sub.path)
-        if path:match("^"..sub.path) and sub.type[operation] then
-          if (check_option(sub.options, option_no_own_events) and uuid == sub.uuid) then
-            logger:debug("suppressing event (%d) with op %s from %s (path=%s) for uuid %s", id, operation, sub.path, path, sub.uuid)
-          else
-            -- Note that we don't check that an event is already in the queue.
-            -- In theory it's possible that one request contains multiple sets and
-            -- several of those sets trigger the same event.
-            logger:debug("queuing event for subscription (%d) with op %s from %s (path=%s) for uuid %s", id, operation, sub.path, path, sub.uuid)
-            event_queue[#event_queue + 1] = { id = id, path = path, operation = operation}
-          end
+  -- Every node on the way down holds subscriptions on a prefix of the path.
+  local node = self.subscription_index
+  for segment in gmatch(path, "[^%.]+") do
+    node = node.children[segment]
+    if not node then
+      break
+    end
+    local ops = node.ops[operation]
+    if ops then
+      queue_subscriptions(event_queue, ops.any, path, operation)
+      for sub_uuid, subscriptions in pairs(ops.not_own) do
+        if sub_uuid ~= uuid then
+          queue_subscriptions(event_queue, subscriptions, path, operation)
+        else
+          logger:debug("suppressing events with op %s (path=%s) for uuid %s", operation, path, sub_uuid)
         end
       end
     end
@@ -205,19 +503,16 @@ local function queue_single_event(self, uuid, mappings, path, operation)
 end
 
 function Eventhor:queueEvent(uuid, mapping, path, operation)
-  local allMappings = self.store:ancestors(mapping)
-  queue_single_event(self, uuid, allMappings, path, operation)
+  queue_single_event(self, uuid, path, operation)
 end
 
-local known_ops = {"set","add","delete"}
 function Eventhor:queueEvents(uuid, mapping, operations)
-  local allMappings = self.store:ancestors(mapping)
   for i = 1, #known_ops do
     local op = known_ops[i]
     local ops = operations[op]
     if ops then
       for _,path in ipairs(ops) do
-        queue_single_event(self, uuid, allMappings, path, op)
+        queue_single_event(self, uuid, path, op)
       end
     else
       logger:debug("op %s not found in operations", op)
@@ -225,45 +520,244 @@ function Eventhor:queueEvents(uuid, mapping, operations)
   end
 end
 
-local function fire_event(self, subscr_id, path, event_type)
-  local address = self.subscriptionlist[subscr_id].addr
-  local sk = sockets[address]
-  if not sk then
-    -- Socket creation failed. Drop event or retry?
+--- Send the given events of a subscription.
+-- Subscriptions that asked for batching get as many events per datagram
+-- as fit, the others get one datagram per event.
+-- @param sub The subscription.
+-- @param events Array of events; coalesced entries are `false`.
+local function send_events(self, sub, events)
+  local subscr_id, address = sub.ID, sub.addr
+  local tag = sub.batch and tags.EVENTS or tags.EVENT
+  local count = 0
+  for i = 1, #events do
+    local event = events[i]
+    if event then
+      logger:debug("firing event (%d) with op %s from %s", subscr_id, event.operation, event.path)
+      local mask = type_2mask(event.operation)
+      if count > 0 and not msg:encode(subscr_id, event.path, mask, "0") then
+        -- datagram is full; send it and start a new one
+        msg:mark_last()
+        if not send_to(self, address, msg:retrieve_data()) then
+          return
+        end
+        count = 0
+      end
+      if count == 0 then
+        msg:init_encode(tag, max_size)
+        msg:encode(subscr_id, event.path, mask, "0")
+      end
+      count = count + 1
+      if not sub.batch then
+        msg:mark_last()
+        if not send_to(self, address, msg:retrieve_data()) then
+          return
+        end
+        count = 0
+      end
+    end
+  end
+  if count > 0 then
+    msg:mark_last()
+    send_to(self, address, msg:retrieve_data())
+  end
+end
+
+--- Add an event to the pending events of a subscription.
+-- An earlier pending event with the same path and operation is dropped so
+-- the subscriber gets it once, in the position of its last occurrence.
+local function add_pending(self, sub, path, operation)
+  local pending = sub.pending
+  if not pending then
+    pending = { events = {}, index = {} }
+    sub.pending = pending
+    self.pending_subs[sub.ID] = sub
+  end
+  local events, index = pending.events, pending.index
+  local key = operation .. "\0" .. path
+  local pos = index[key]
+  if pos then
+    events[pos] = false
+  end
+  pos = #events + 1
+  events[pos] = { path = path, operation = operation }
+  index[key] = pos
+end
+
+local release_subscription
+
+--- Deliver the pending events of a subscription unless it is being held
+-- back by its minimum interval.
+local function flush_subscription(self, sub)
+  if sub.held then
     return
   end
-  msg:init_encode(tags.EVENT, max_size)
-  msg:encode(subscr_id, path, type_2mask(event_type), "0")
-  msg:mark_last()
-  local rc, errmsg = sk:send(msg:retrieve_data())
-  if not rc then
-    sk:close()
-    sockets[address] = nil
-    if errmsg then
-      logger:error("failed to send event: %s", errmsg)
-    end
+  local pending = sub.pending
+  sub.pending = nil
+  self.pending_subs[sub.ID] = nil
+  send_events(self, sub, pending.events)
+  local schedule = self.schedule
+  if sub.min_interval > 0 and schedule then
+    sub.held = true
+    schedule(function()
+      release_subscription(self, sub)
+    end, sub.min_interval)
   end
 end
 
-function Eventhor:fireEvents()
-  for _, event in pairs(self.event_queue) do
-    logger:debug("firing event (%d) with op %s from %s", event.id, event.operation, event.path)
-    fire_event(self, event.id, event.path, event.operation)
+--- The minimum interval of a subscription has elapsed; deliver what was
+-- generated in the meantime.
+release_subscription = function(self, sub)
+  sub.held = nil
+  if sub.pending and self.subscriptionlist[sub.ID] == sub then
+    flush_subscription(self, sub)
   end
+end
+
+--- Fire the queued events.
+-- Events are coalesced per subscription and delivered right away unless
+-- the subscription is held back by its minimum interval.
+function Eventhor:fireEvents()
+  local event_queue = self.event_queue
   self.event_queue = {}
+  local sublist = self.subscriptionlist
+  for i = 1, #event_queue do
+    local event = event_queue[i]
+    local sub = sublist[event.id]
+    if sub then
+      add_pending(self, sub, event.path, event.operation)
+    end
+  end
+  for _, sub in pairs(self.pending_subs) do
+    flush_subscription(self, sub)
+  end
+end
+
+--- Set the function used to postpone event delivery for subscriptions with
+-- a minimum interval. Without it the minimum interval is not enforced.
+-- @param schedule A function taking a callback and a delay in milliseconds.
+function Eventhor:setScheduler(schedule)
+  self.schedule = schedule
+end
+
+--- Set the function used to wait for a subscriber socket to become
+-- writable again. Without it queued events are only retried when new
+-- events are sent to the same address.
+-- @param watch A function taking a file descriptor and a callback. It must
+--   return an object with a `delete()` method to stop watching.
+function Eventhor:setWriteWatcher(watch)
+  self.watch_writable = watch
+end
+
+--- Retrieve the delivery statistics per subscriber address.
+-- @return A table with per address a table with the fields `queued` (number
+--   of datagrams waiting), `max_queued`, `sent`, `dropped` and `resyncs`.
+function Eventhor:subscriberStats()
+  local stats = {}
+  for address, box in pairs(self.outboxes) do
+    stats[address] = {
+      queued = outbox_length(box),
+      max_queued = box.max_queued,
+      sent = box.sent,
+      dropped = box.dropped,
+      resyncs = box.resyncs,
+    }
+  end
+  return stats
 end
 
 function Eventhor:dropEvents()
   self.event_queue = {}
 end
 
+--- Record changes that were detected without going through the event
+-- queue, e.g. instances that appeared or disappeared when a mapping was
+-- synchronized.
+-- @param #table paths The changed paths.
+-- @param #string operation The operation ("set", "add" or "delete").
+function Eventhor:recordChanges(paths, operation)
+  for i = 1, #paths do
+    record_change(self, paths[i], operation)
+  end
+end
+
+--- Ask whether the change journal is recording.
+function Eventhor:isJournaling()
+  return self.journal.active == true
+end
+
+--- Retrieve a token for the current state of the change journal.
+-- The first call starts the journal and the event source watches; only
+-- mappings that are watched can report their changes.
+-- @return #string The change token.
+function Eventhor:changeToken()
+  local journal = self.journal
+  if not journal.active then
+    start_watching(self)
+    journal.active = true
+  end
+  return self.epoch .. "-" .. journal.seq
+end
+
+--- Retrieve the changes recorded after a change token was handed out.
+-- @param #string token A token returned by changeToken().
+-- @return #table, #number An array of the changes in the order in which
+--   they happened, each a table with `path` and `operation` fields, and the
+--   sequence number of the last one. Nil if the token is unknown (e.g. it
+--   was handed out before a restart) or the changes since then no longer
+--   fit in the journal.
+function Eventhor:changesSince(token)
+  local journal = self.journal
+  local epoch, seq = match(token or "", "^(%x+)%-(%d+)$")
+  seq = tonumber(seq)
+  if not journal.active or epoch ~= self.epoch or not seq
+     or seq > journal.seq or seq < journal.seq - journal.size then
+    return nil
+  end
+  local changes = {}
+  local size, paths, ops = journal.size, journal.paths, journal.ops
+  for i = seq + 1, journal.seq do
+    local slot = i % size + 1
+    changes[#changes + 1] = { path = paths[slot], operation = ops[slot] }
+  end
+  return changes, journal.seq
+end
+
 local M = {
-  new = function(store)
+  --- Create an Eventhor.
+  -- @param store The typestore.
+  -- @param queue_size (optional) The maximum number of datagrams queued per
+  --   subscriber address.
+  -- @param overflow (optional) What to do when a queue is full: "drop_oldest"
+  --   (the default) or "resync".
+  -- @param journal_size (optional) The number of changes kept in the change
+  --   journal.
+  new = function(store, queue_size, overflow, journal_size)
+    if overflow and not overflow_policies[overflow] then
+      logger:warning("unknown event overflow policy %s, using drop_oldest", tostring(overflow))
+      overflow = nil
+    end
+    if journal_size and journal_size < 1 then
+      logger:warning("invalid change journal size %s, using %d", tostring(journal_size), default_journal_size)
+      journal_size = nil
+    end
     local self = {
       store = store,
       subscriptionlist = {},
+      subscription_index = new_index_node(),
       subscriptions_counter = 0,
       event_queue = {},
+      -- subscriptions with coalesced events waiting to be delivered
+      pending_subs = {},
+      schedule = nil,
+      -- outbound queue per subscriber address
+      outboxes = {},
+      queue_size = queue_size or default_queue_size,
+      overflow = overflow or "drop_oldest",
+      watch_writable = nil,
+      watching = false,
+      -- recent changes, see changeToken()
+      journal = new_journal(journal_size or default_journal_size),
+      epoch = format("%x%04x", time(), random(0, 0xffff)),
     }
     store:registerEventhor(self)
     return setmetatable(self, Eventhor)
@@ -32,14 +32,105 @@ local format = string.format
 
 local resolve = require("transformer.xref").resolve
 local logger = require("tch.logger")
+local trlock = require("transformer.lock").Lock("transformer")
 
--- Array of all registered watches, grouped per config.
--- Since config is mandatory we can group them so we don't need
--- to do a linear scan of all watches when we're matching.
+-- Index of all registered watches.
+-- Since config is mandatory the watches are first grouped per config.
+-- Within a config they are indexed on section name and then on option;
+-- watches without section name or option go in the `any` bucket of
+-- their level. A change is matched by looking at (at most) four lists
+-- instead of scanning all watches on the config.
+--   watches[config] = {
+--     sections = { [sectionname] = { options = { [option] = {...} }, any = {...} } },
+--     any = { options = { [option] = {...} }, any = {...} },
+--   }
 local watches = {}
 
 local store
 
+-- Resolved paths per mapping and key. A single request can cause the same
+-- instance to be evented many times (e.g. a bulk import through one
+-- mapping), so the result of resolve() is reused for the rest of the
+-- request. The next request can delete or renumber the instance, so the
+-- cache is emptied when a request starts (see start()) and when the
+-- Transformer lock is released after work done outside of a request.
+local resolved = {}
+local resolved_empty = true
+
+local function clear_resolved()
+  if not resolved_empty then
+    resolved = {}
+    resolved_empty = true
+  end
+end
+
+trlock:set_listener("uci_eventsource", clear_resolved)
+
+local function resolve_cached(mapping, key)
+  local paths = resolved[mapping]
+  local path = paths and paths[key]
+  if path then
+    return path
+  end
+  path = resolve(store, mapping.objectType.name, key, true)
+  -- Only successful resolves are kept; the instance might still be
+  -- created later in the request.
+  if path then
+    if not paths then
+      paths = {}
+      resolved[mapping] = paths
+    end
+    paths[key] = path
+    if resolved_empty then
+      resolved_empty = false
+      -- make sure the listener runs when the request is done
+      trlock:notify()
+    end
+  end
+  return path
+end
+
+-- Add the callbacks of the matching watches in 'list' to 'callbacks'.
+-- We only call a specific callback once per mapping. This is to avoid
+-- duplicate events when a mapping uses overlapping watches with
+-- the same callback.
+-- The idea is that for a given change on UCI a particular callback is
+-- never called more than once with the same arguments.
+local function collect_callbacks(callbacks, list, action)
+  if not list then
+    return callbacks
+  end
+  for _, watch in ipairs(list) do
+    local cb = watch[action]
+    if cb then
+      -- for each matching watch put it in the 'callbacks' table
+      -- if it's not already there
+      local mapping = watch.mapping
+      callbacks = callbacks or {}
+      local cb_mappings = callbacks[cb]
+      if not cb_mappings then
+        cb_mappings = {}
+        callbacks[cb] = cb_mappings
+      end
+      if not cb_mappings[mapping] then
+        logger:debug("storing callback for %s", mapping.objectType.name)
+        cb_mappings[mapping] = true
+      end
+    end
+  end
+  return callbacks
+end
+
+local function collect_bucket(callbacks, bucket, action, option)
+  if not bucket then
+    return callbacks
+  end
+  if option then
+    callbacks = collect_callbacks(callbacks, bucket.options[option], action)
+  end
+  return collect_callbacks(callbacks, bucket.any, action)
+end
+
 -- TODO: pass section type
 local function check_watches(action, config, sectionname, option)
   logger:debug("checking watches for %s on %s.%s.%s", action, config, sectionname, option)
@@ -48,31 +139,13 @@ local function check_watches(action, config, sectionname, option)
     return
   end
   -- Collect the callbacks.
-  -- We only call a specific callback once per mapping. This is to avoid
-  -- duplicate events when a mapping uses overlapping watches with
-  -- the same callback.
-  -- The idea is that for a given change on UCI a particular callback is
-  -- never called more than once with the same arguments.
-  local callbacks = {}
-  for _, watch in ipairs(group) do
-    if (not watch.sectionname or watch.sectionname == sectionname) and
-       (not watch.option or watch.option == option) then
-      local cb = watch[action]
-      if cb then
-        -- for each matching watch put it in the 'callbacks' table
-        -- if it's not already there
-        local mapping = watch.mapping
-        local cb_mappings = callbacks[cb]
-        if not cb_mappings then
-          cb_mappings = {}
-          callbacks[cb] = cb_mappings
-        end
-        if not cb_mappings[mapping] then
-          logger:debug("storing callback for %s", mapping.objectType.name)
-          cb_mappings[mapping] = true
-        end
-      end
-    end
+  local callbacks
+  if sectionname then
+    callbacks = collect_bucket(callbacks, group.sections[sectionname], action, option)
+  end
+  callbacks = collect_bucket(callbacks, group.any, action, option)
+  if not callbacks then
+    return
   end
   -- Now invoke all the collected callbacks.
   for cb, mappings in pairs(callbacks) do
@@ -90,8 +163,7 @@ local function check_watches(action, config, sectionname, option)
           else
             -- TODO: should we allow a 'typepath' field so mapping can send an event for a
             --       different type than the one of the mapping associated with the watch?
-            -- TODO optimize call to resolve (one of the first thing it does, is look for mapping. Can it not simple be passed?)
-            local path = resolve(store, mapping.objectType.name, info.key, true)
+            local path = resolve_cached(mapping, info.key)
             if path then
               path = path .. "."
               if info.paramname then
@@ -219,11 +291,33 @@ function M.watch(mapping, actions, config, sectiontype, sectionname, option)
   -- difference while saving the overhead of the separate table and extra level of indirection.
   local group = watches[config]
   if not group then
-    group = {}
+    group = { sections = {}, any = { options = {}, any = {} } }
     watches[config] = group
   end
-  group[#group + 1] = { mapping = mapping, sectiontype = sectiontype, sectionname = sectionname,
-                        option = option, set = actions.set, add = actions.add, del = actions.del }
+  local bucket = group.any
+  if sectionname then
+    bucket = group.sections[sectionname]
+    if not bucket then
+      bucket = { options = {}, any = {} }
+      group.sections[sectionname] = bucket
+    end
+  end
+  local list = bucket.any
+  if option then
+    list = bucket.options[option]
+    if not list then
+      list = {}
+      bucket.options[option] = list
+    end
+  end
+  list[#list + 1] = { mapping = mapping, sectiontype = sectiontype, sectionname = sectionname,
+                      option = option, set = actions.set, add = actions.add, del = actions.del }
+end
+
+--- Function that should be called when Transformer starts handling a request.
+-- The paths resolved while handling earlier requests are forgotten.
+function M.start()
+  clear_resolved()
 end
 
 -- TODO: Ugh, the store is needed to do resolving in check_watches()
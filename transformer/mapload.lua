@@ -15,12 +15,23 @@ local require, type, error, loadfile, setfenv, getfenv, setmetatable, pcall =
       require, type, error, loadfile, setfenv, getfenv, setmetatable, pcall
 local pairs, ipairs, tostring, rawset, next =
       pairs, ipairs, tostring, rawset, next
+local concat, sort, unpack = table.concat, table.sort, unpack
+local dump = string.dump
+local floor = math.floor
+local collectgarbage = collectgarbage
+local io = io
+local open, lines, remove, rename = io.open, io.lines, os.remove, os.rename
 local lfs = require("lfs")
+local crypto = require("tch.crypto")
+local lfsync = require("lfsync")
+local fsync, private_dir = lfsync.fsync, lfsync.private_dir
 local logger = require("tch.logger")
 local maphelper = require 'transformer.maphelper'
 local xref = require 'transformer.xref'
+local typecheck = require 'transformer.typecheck'
 local xpcall = require ("tch.xpcall")
 local traceback = debug.traceback
+local getinfo = debug.getinfo
 
 local default_hidden_values = {
   base64 = "",
@@ -322,20 +333,130 @@ local function memoize_paramtypes(mapping)
   local paramtypes = mapping.parameters
 
   for name, paramtype in pairs(paramtypes) do
-    paramtypes[name] = memoize_paramtype(paramtype)
+    paramtype = memoize_paramtype(paramtype)
+    paramtypes[name] = paramtype
+    -- compile the value check now rather than on the first set
+    typecheck.compile(paramtype)
   end
 end
 
-local function create_map_env(store, commitapply, ignore_patterns, vendor_patterns, unhide_patterns)
+--- Apply what validate_mapping() did to a mapping the last time it was
+-- validated, as recorded in the snapshot.
+local function apply_validation(mapping, removed)
+  local objtype = mapping.objectType
+  objtype.description = nil
+  local parameters = objtype.parameters
+  for _, ptype in pairs(parameters) do
+    ptype.description = nil
+  end
+  if removed then
+    for _, pname in ipairs(removed) do
+      if pname == true then
+        objtype.numEntriesParameter = nil
+      else
+        parameters[pname] = nil
+      end
+    end
+  end
+end
+
+--- Remember the parameters of a mapping before it is validated, so
+-- record_validation() can tell which ones validate_mapping() dropped.
+local function before_validation(mapping, snapshot)
+  local objtype = mapping.objectType
+  if not snapshot or type(objtype) ~= "table" or type(objtype.parameters) ~= "table" then
+    return
+  end
+  local pnames = {}
+  for pname in pairs(objtype.parameters) do
+    pnames[#pnames + 1] = pname
+  end
+  return pnames, objtype.numEntriesParameter
+end
+
+--- Record the outcome of validate_mapping() in the snapshot being built.
+local function record_validation(mapping, snapshot, pnames, numEntries, ok, reason)
+  if not snapshot then
+    return
+  end
+  snapshot.extended = true
+  local objtype = mapping.objectType
+  if not pnames or not objtype.name then
+    return
+  end
+  local removed = {}
+  for _, pname in ipairs(pnames) do
+    if objtype.parameters[pname] == nil then
+      removed[#removed + 1] = pname
+    end
+  end
+  if numEntries and not objtype.numEntriesParameter then
+    removed[#removed + 1] = true
+  end
+  if ok then
+    snapshot.removed[objtype.name] = removed[1] and removed
+  else
+    snapshot.typepaths[objtype.name] = false
+    snapshot.reasons[objtype.name] = reason
+  end
+end
+
+-- The inputs read by the map file that is being loaded by
+-- load_map_recorded(), as a set of file paths.
+local inputs_read
+
+local function read_input(path)
+  if inputs_read then
+    inputs_read[path] = true
+  end
+end
+
+-- The io library as seen by the maps; it notes the files they read.
+local map_io = setmetatable({
+  open = function(file, mode)
+    if not mode or find(mode, "^r") then
+      read_input(file)
+    end
+    return open(file, mode)
+  end,
+  lines = function(file)
+    if file then
+      read_input(file)
+    end
+    return lines(file)
+  end,
+}, { __index = io })
+
+local function create_map_env(store, commitapply, ignore_patterns, vendor_patterns, unhide_patterns, snapshot)
   -- The environment available to a mapping.
   -- All these functions can throw an error.
   local function register(mapping)
-    local ok, reason = validate_mapping(mapping, ignore_patterns, vendor_patterns)
+    local ok, reason, tp_id
+    local name = type(mapping.objectType) == "table" and mapping.objectType.name
+    local file_names = snapshot and snapshot.file_names
+    if file_names and name then
+      file_names[#file_names + 1] = name
+    end
+    if snapshot and snapshot.valid and name and snapshot.typepaths[name] ~= nil then
+      -- This mapping validated before and nothing changed since.
+      tp_id = snapshot.typepaths[name]
+      ok, reason = tp_id, snapshot.reasons[name]
+      if ok then
+        apply_validation(mapping, snapshot.removed[name])
+      end
+    else
+      local pnames, numEntries = before_validation(mapping, snapshot)
+      ok, reason = validate_mapping(mapping, ignore_patterns, vendor_patterns)
+      record_validation(mapping, snapshot, pnames, numEntries, ok, reason)
+    end
     if ok then
       hidden_mapping(mapping, unhide_patterns)
       alias_mapping(store, mapping)
       memoize_paramtypes(mapping.objectType)
-      store:add_mapping(mapping)
+      store:add_mapping(mapping, tp_id or nil)
+      if snapshot then
+        snapshot.typepaths[name] = mapping.tp_id
+      end
     else
       logger:info(reason)
     end
@@ -351,6 +472,10 @@ local function create_map_env(store, commitapply, ignore_patterns, vendor_patter
     end,
     mapper = function(name)
       local mapper = require("transformer.mapper." .. name)
+      -- A mapper that reads configuration tells which files it reads.
+      if type(mapper.observe_reads) == "function" then
+        mapper.observe_reads(read_input)
+      end
       -- When a function of the mapper is called we want to access
       -- the commitapply context in that function. To be able to do
       -- that the mapper function must have the environment that is
@@ -370,7 +495,8 @@ local function create_map_env(store, commitapply, ignore_patterns, vendor_patter
     end,
     query_keys = function(mapping, level)
       return store.persistency:query_keys(mapping.tp_id, level)
-    end
+    end,
+    io = map_io,
   }
   -- in your map you can access everything but you're
   -- not allowed to create new global variables
@@ -383,9 +509,46 @@ local function create_map_env(store, commitapply, ignore_patterns, vendor_patter
   return map_env
 end
 
+-- Write the compiled form of a map file chunk.
+-- Bytecode isn't verified when it's loaded, so it must be complete on
+-- storage before it gets its final name.
+local function save_chunk(compiled, chunk)
+  local tmp = compiled .. ".tmp"
+  local f = open(tmp, "wb")
+  if not f then
+    return
+  end
+  local ok = f:write(dump(chunk))
+  f:close()
+  if not ok or not fsync(tmp) or not rename(tmp, compiled) then
+    remove(tmp)
+  end
+end
+
+-- Load the chunk of the map file 'file'. When the snapshot knows the
+-- checksum of the file its compiled form is used, so the source doesn't
+-- have to be parsed; it's created when it doesn't exist yet.
+local function load_chunk(file, snapshot)
+  local digest = snapshot and snapshot.digests[file]
+  if not digest then
+    return loadfile(file)
+  end
+  local compiled = snapshot.chunkdir .. "/" .. digest
+  local chunk = loadfile(compiled)
+  if chunk then
+    return chunk
+  end
+  local errmsg
+  chunk, errmsg = loadfile(file)
+  if chunk then
+    save_chunk(compiled, chunk)
+  end
+  return chunk, errmsg
+end
+
 -- Load the map pointed to by 'file' using the provided environment.
-local function load_map(map_env, file)
-  local mapping, errmsg = loadfile(file)
+local function load_map(map_env, file, snapshot)
+  local mapping, errmsg = load_chunk(file, snapshot)
   if not mapping then
     -- file not found or syntax error in map
     return nil, errmsg
@@ -455,14 +618,101 @@ local function fixupNumberOfEntries(store)
     end
 end
 
+-- Compute the checksum of the content of the given files.
+local function inputs_digest(paths)
+  local parts = {}
+  for _, path in ipairs(paths) do
+    local content = "\0"
+    local f = open(path, "r")
+    if f then
+      content = f:read("*a") or ""
+      f:close()
+    end
+    parts[#parts + 1] = path .. "\0" .. content
+  end
+  return crypto.md5(concat(parts, "\0"))
+end
+
+-- Check whether the inputs a map file read the last time it was loaded
+-- are still the same, so it registers the same typepaths again.
+local function inputs_unchanged(snapshot, file)
+  local inputs = snapshot.inputs[file]
+  return not inputs or inputs[1] == inputs_digest({ unpack(inputs, 2) })
+end
+
+-- Load the map pointed to by 'file' and record in the snapshot which
+-- typepaths it registered, which files (like UCI configs) it read while
+-- doing that and roughly how much heap that took.
+local function load_map_recorded(map_env, file, snapshot)
+  if not snapshot then
+    return load_map(map_env, file, snapshot)
+  end
+  local names = {}
+  snapshot.file_names = names
+  inputs_read = {}
+  local before = collectgarbage("count")
+  local rc, errmsg = load_map(map_env, file, snapshot)
+  local size = collectgarbage("count") - before
+  local read = inputs_read
+  snapshot.file_names = nil
+  inputs_read = nil
+  if rc then
+    -- A garbage collection step during the load can make this negative.
+    -- Whole KiB are precise enough and keep the reported totals integers.
+    snapshot.files[file] = { size > 0 and floor(size) or 0, unpack(names) }
+    local paths = {}
+    for path in pairs(read) do
+      paths[#paths + 1] = path
+    end
+    sort(paths)
+    -- The inputs only matter when map files are deferred; don't rewrite
+    -- the snapshot for them otherwise.
+    local inputs = snapshot.inputs[file]
+    if paths[1] then
+      local digest = inputs_digest(paths)
+      if not inputs or inputs[1] ~= digest or concat(inputs, "\0", 2) ~= concat(paths, "\0") then
+        snapshot.inputs[file] = { digest, unpack(paths) }
+        snapshot.extended = snapshot.extended or snapshot.lazy
+      end
+    elseif inputs then
+      snapshot.inputs[file] = nil
+      snapshot.extended = snapshot.extended or snapshot.lazy
+    end
+  end
+  return rc, errmsg
+end
+
+-- Load the map pointed to by 'file', or only register the typepaths it
+-- provides and load it on first use when the snapshot allows that.
+-- A map file is not deferred when the files it read the last time it was
+-- loaded changed since, as it may register other typepaths now.
+local function load_or_defer(store, map_env, file, snapshot)
+  local entry = snapshot and snapshot.valid and snapshot.lazy and snapshot.files[file]
+  if entry and entry[2] and not inputs_unchanged(snapshot, file) then
+    logger:info("%s read changed configuration; not deferring it", file)
+    entry = nil
+  end
+  if entry and entry[2] then
+    store:defer({ unpack(entry, 2) }, function()
+      local rc, errmsg = load_map(map_env, file, snapshot)
+      if not rc then
+        logger:error("%s ignored (%s)", file, errmsg)
+      end
+      fixupNumberOfEntries(store)
+    end, entry[1])
+    return true
+  end
+  return load_map_recorded(map_env, file, snapshot)
+end
+
 -- Load all the maps on the specified path recursively and store them in
 -- the provided map environment.
-local function load_maps_recursively(map_env, mappath)
+local function load_maps_recursively(store, map_env, mappath, snapshot)
   -- if 'mappath' points to a file then load that file
   if lfs.attributes(mappath, 'mode') == 'file' then
     -- only consider files with the '.map' extension
     if find(mappath, "%.map$") then
-      local rc, errormsg = load_map(map_env, mappath)
+      local rc, errormsg = load_or_defer(store, map_env, mappath, snapshot)
       -- currently we just ignore maps that fail to load
       if not rc then
         logger:error("%s ignored (%s)", mappath, errormsg)
@@ -472,7 +722,7 @@ local function load_maps_recursively(map_env, mappath)
   elseif lfs.attributes(mappath, 'mode') == 'directory' then
     for file in lfs.dir(mappath) do
       if file ~= "." and file ~= ".." then
-        load_maps_recursively(map_env, mappath.."/"..file)
+        load_maps_recursively(store, map_env, mappath.."/"..file, snapshot)
       end
     end
   end
@@ -490,23 +740,255 @@ local M = {}
 -- @param ignore_patterns A table of datamodel patterns that need to be ignored by Transformer.
 -- @param vendor_patterns A table of vendor extension patterns that need to be allowed by Transformer.
 -- @param unhide_patterns A table of datamodel patterns that must not be hidden by Transformer.
+-- @param snapshot (optional) A snapshot as returned by open_snapshot().
 -- @return 'true' if all went well and nil + error message otherwise
-function M.load_all_maps(store, commitapply, mappath, ignore_patterns, vendor_patterns, unhide_patterns)
-  local map_env = create_map_env(store, commitapply, ignore_patterns, vendor_patterns, unhide_patterns)
+function M.load_all_maps(store, commitapply, mappath, ignore_patterns, vendor_patterns, unhide_patterns, snapshot)
+  local map_env = create_map_env(store, commitapply, ignore_patterns, vendor_patterns, unhide_patterns, snapshot)
   -- a single mapping file is provided
   store.persistency:startTransaction()
   if lfs.attributes(mappath, 'mode') == 'file' then
-    local rc, errmsg = load_map(map_env, mappath)
+    local rc, errmsg = load_or_defer(store, map_env, mappath, snapshot)
     if not rc then
       return nil, errmsg
     end
   -- a directory with mapping files is provided
   else
-    load_maps_recursively(map_env, mappath)
+    load_maps_recursively(store, map_env, mappath, snapshot)
   end
   fixupNumberOfEntries(store)
   store.persistency:commitTransaction()
   return true
 end
 
+--- Snapshots.
+-- Loading the maps validates every mapping and registers its typepath in
+-- the database. A snapshot records the outcome of both (the typepath IDs,
+-- the mappings that were ignored and the parameters that were dropped) so
+-- the next start can skip that work when nothing changed. It is keyed on
+-- the modification time and checksum of all map files, the ignore, vendor
+-- and unhide patterns, the highest typepath ID in the database and the
+-- checksum of the Transformer code (see get_code_digest()).
+-- Mappings that aren't in the snapshot are still validated as usual.
+-- The snapshot also records which typepaths each map file registers and
+-- roughly how much heap loading it took, so a lazy snapshot can defer
+-- loading the map file until its typepaths are used (see TypeStore:defer()).
+-- What a map file registers can depend on the configuration, so the files
+-- it read while loading (UCI configs read through the UCI helper and files
+-- opened with io.open() or io.lines()) and their checksum are recorded too.
+-- When one of them changed the map file is loaded at startup again.
+-- Next to the snapshot, in a directory with the same name and a '.d'
+-- suffix, the compiled (bytecode) form of every map file is kept. It's
+-- named after the checksum of the source so it can't get out of date, and
+-- loading it skips parsing the large table constructors of the mappings.
+-- Lua doesn't verify bytecode, so the directory is only used when no one
+-- but us can write in it.
+local snapshot_version = 3
+
+local function collect_map_files(mappath, files)
+  local mode = lfs.attributes(mappath, 'mode')
+  if mode == 'file' then
+    if find(mappath, "%.map$") then
+      files[#files + 1] = mappath
+    end
+  elseif mode == 'directory' then
+    for file in lfs.dir(mappath) do
+      if file ~= "." and file ~= ".." then
+        collect_map_files(mappath.."/"..file, files)
+      end
+    end
+  end
+end
+
+-- The checksum of the Transformer modules and the mappers. They decide
+-- how the maps are validated and what they register, so a snapshot made by
+-- other code (e.g. before a firmware upgrade) can't be used.
+-- It's computed once; the code doesn't change while Transformer runs.
+local code_digest
+
+local function get_code_digest()
+  if code_digest then
+    return code_digest
+  end
+  local parts = {}
+  -- the directory this module was loaded from
+  local dir = match(getinfo(1, "S").source, "^@(.*)/[^/]*$")
+  if dir then
+    for _, subdir in ipairs({ dir, dir .. "/mapper" }) do
+      local files = {}
+      if lfs.attributes(subdir, 'mode') == 'directory' then
+        for file in lfs.dir(subdir) do
+          if find(file, "%.lua$") then
+            files[#files + 1] = subdir .. "/" .. file
+          end
+        end
+      end
+      sort(files)
+      for _, file in ipairs(files) do
+        local f = open(file, "rb")
+        if f then
+          parts[#parts + 1] = file .. "\0" .. (f:read("*a") or "")
+          f:close()
+        end
+      end
+    end
+  end
+  code_digest = crypto.md5(concat(parts, "\0"))
+  return code_digest
+end
+
+local function snapshot_signature(store, mappaths, ignore_patterns, vendor_patterns, unhide_patterns, digests)
+  local files = {}
+  for _, mappath in ipairs(mappaths) do
+    collect_map_files(mappath, files)
+  end
+  sort(files)
+  local parts = { "v" .. snapshot_version, "tp" .. store.persistency:lastTypePathID(), "code" .. get_code_digest() }
+  for _, file in ipairs(files) do
+    local attr = lfs.attributes(file)
+    local content = ""
+    local f = open(file, "r")
+    if f then
+      content = f:read("*a") or ""
+      f:close()
+    end
+    local digest = crypto.md5(content)
+    if digests then
+      digests[file] = digest
+    end
+    parts[#parts + 1] = format("%s:%s:%s", file, tostring(attr and attr.modification), digest)
+  end
+  for _, patterns in ipairs({ ignore_patterns or {}, vendor_patterns or {}, unhide_patterns or {} }) do
+    parts[#parts + 1] = concat(patterns, "\1")
+  end
+  return concat(parts, "\n")
+end
+
+--- Open the snapshot for the given map paths.
+-- @param store The typestore in which the maps will be loaded.
+-- @param file The location of the snapshot file.
+-- @param mappaths An array with the map paths that will be loaded.
+-- @param ignore_patterns, vendor_patterns, unhide_patterns The patterns
+--   the maps will be loaded with.
+-- @param lazy (optional) If true, map files are only loaded when their
+--   typepaths are first used; this needs a valid snapshot.
+-- @return A snapshot to pass to load_all_maps() and save_snapshot(). Its
+--   `valid` field tells whether the stored snapshot can be used.
+function M.open_snapshot(store, file, mappaths, ignore_patterns, vendor_patterns, unhide_patterns, lazy)
+  local digests = {}
+  local signature = snapshot_signature(store, mappaths, ignore_patterns, vendor_patterns, unhide_patterns, digests)
+  local snapshot = { file = file, valid = false, lazy = lazy, typepaths = {}, removed = {}, reasons = {}, files = {},
+                     inputs = {}, digests = digests, chunkdir = file .. ".d" }
+  local ok, errmsg = private_dir(snapshot.chunkdir)
+  if not ok then
+    -- without a safe place to keep them the maps are loaded from source
+    logger:warning("not using compiled maps: %s", errmsg)
+    snapshot.chunkdir = nil
+    snapshot.digests = {}
+  end
+  local chunk = loadfile(file)
+  if chunk then
+    setfenv(chunk, {})
+    local ok, stored = pcall(chunk)
+    if ok and type(stored) == "table" and stored.version == snapshot_version
+       and stored.signature == signature then
+      snapshot.valid = true
+      snapshot.typepaths = stored.typepaths
+      snapshot.removed = stored.removed
+      snapshot.reasons = stored.reasons
+      snapshot.files = stored.files
+      snapshot.inputs = stored.inputs
+      logger:info("using map snapshot %s", file)
+    end
+  end
+  return snapshot
+end
+
+local function write_table(out, t)
+  out[#out + 1] = "{"
+  for k, v in pairs(t) do
+    out[#out + 1] = format("[%q]=", k)
+    if type(v) == "table" then
+      out[#out + 1] = "{"
+      for _, e in ipairs(v) do
+        if type(e) == "string" then
+          out[#out + 1] = format("%q,", e)
+        else
+          out[#out + 1] = tostring(e) .. ","
+        end
+      end
+      out[#out + 1] = "},"
+    elseif type(v) == "string" then
+      out[#out + 1] = format("%q,", v)
+    else
+      out[#out + 1] = tostring(v) .. ","
+    end
+  end
+  out[#out + 1] = "}"
+end
+
+-- Remove the compiled map files that don't match any of the given checksums.
+local function remove_stale_chunks(chunkdir, digests)
+  if lfs.attributes(chunkdir, 'mode') ~= 'directory' then
+    return
+  end
+  local current = {}
+  for _, digest in pairs(digests) do
+    current[digest] = true
+  end
+  for name in lfs.dir(chunkdir) do
+    if name ~= "." and name ~= ".." and not current[name] then
+      remove(chunkdir .. "/" .. name)
+    end
+  end
+end
+
+--- Save the snapshot after all maps are loaded, unless the stored one was
+-- used and is still up to date.
+-- @param store The typestore in which the maps were loaded.
+-- @param snapshot The snapshot returned by open_snapshot().
+-- @param mappaths, ignore_patterns, vendor_patterns, unhide_patterns The
+--   same values as given to open_snapshot().
+-- @return true or nil + error message
+function M.save_snapshot(store, snapshot, mappaths, ignore_patterns, vendor_patterns, unhide_patterns)
+  if snapshot.valid and not snapshot.extended then
+    return true
+  end
+  local digests = {}
+  local signature = snapshot_signature(store, mappaths, ignore_patterns, vendor_patterns, unhide_patterns, digests)
+  if snapshot.chunkdir then
+    remove_stale_chunks(snapshot.chunkdir, digests)
+  end
+  local out = { format("return {version=%d,signature=%q,typepaths=", snapshot_version, signature) }
+  write_table(out, snapshot.typepaths)
+  out[#out + 1] = ",removed="
+  write_table(out, snapshot.removed)
+  out[#out + 1] = ",reasons="
+  write_table(out, snapshot.reasons)
+  out[#out + 1] = ",files="
+  write_table(out, snapshot.files)
+  out[#out + 1] = ",inputs="
+  write_table(out, snapshot.inputs)
+  out[#out + 1] = "}\n"
+  local tmp = snapshot.file .. ".tmp"
+  local f, errmsg = open(tmp, "w")
+  if not f then
+    return nil, errmsg
+  end
+  local ok
+  ok, errmsg = f:write(concat(out))
+  f:close()
+  -- make sure the content is on storage before the rename is
+  if ok then
+    ok, errmsg = fsync(tmp)
+  end
+  if ok then
+    ok, errmsg = rename(tmp, snapshot.file)
+  end
+  if not ok then
+    remove(tmp)
+    return nil, errmsg
+  end
+  return fsync(match(snapshot.file, "^(.*)/[^/]*$") or ".")
+end
+
 return M
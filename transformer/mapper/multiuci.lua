@@ -254,7 +254,7 @@ local function commit(mapping)
   local binding = {
     config = mapping.binding["config"]
   } --transformer.mapper.ucihelper#binding
-  return uci_helper.commit(binding)
+  return uci_helper.commit_grouped(binding)
 end
 
 --- A generic revert function for a multi instance uci object.
@@ -95,7 +95,7 @@ local function commit(mapping)
   logger:debug("simpleuci: committing")
   local result = true
   for _,binding in pairs(mapping.transaction) do
-    if not uci_helper.commit(binding) then
+    if not uci_helper.commit_grouped(binding) then
       result = false
     end
   end
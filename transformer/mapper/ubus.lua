@@ -23,13 +23,67 @@ See LICENSE file for more details.
 --
 -- and then later
 -- conn:call(...)
+--
+-- Mappings that call e.g. `network.interface dump` for every instance can
+-- use conn:call_cached(path, method, args) instead. While Transformer handles
+-- a request that only reads the datamodel its results are remembered per
+-- object, method and arguments, so only one call is done. The results are
+-- shared between all callers so they must not be modified.
+
+local logger = require("tch.logger")
+local metrics = require("transformer.metrics")
+local now, record = metrics.now, metrics.record
+local pairs, ipairs, tostring, type = pairs, ipairs, tostring, type
+local sort, concat = table.sort, table.concat
+
+-- The cached call results, indexed on the key built by call_key().
+-- `ttl` is nil while no results may be used, 0 while they are only used
+-- within the current request and otherwise the number of seconds they
+-- stay valid.
+local cache = {
+  results = {},
+  ttl = nil,
+  hits = 0,
+  misses = 0,
+}
+
+local function add_value(v, buf)
+  if type(v) == "table" then
+    local keys = {}
+    for k in pairs(v) do
+      keys[#keys + 1] = k
+    end
+    sort(keys, function(a, b)
+      return tostring(a) < tostring(b)
+    end)
+    buf[#buf + 1] = "{"
+    for _, k in ipairs(keys) do
+      buf[#buf + 1] = tostring(k)
+      buf[#buf + 1] = "="
+      add_value(v[k], buf)
+      buf[#buf + 1] = ","
+    end
+    buf[#buf + 1] = "}"
+  else
+    buf[#buf + 1] = type(v)
+    buf[#buf + 1] = ":"
+    buf[#buf + 1] = tostring(v)
+  end
+end
+
+local function call_key(path, method, args)
+  local buf = { path, "\0", method, "\0" }
+  if args ~= nil then
+    add_value(args, buf)
+  end
+  return concat(buf)
+end
 
 -- Setup a single ubus connection to share with all mappings.
 -- Make sure no-one can close the shared connection.
 -- For event sending we need to use a different connection.
 -- Otherwise somebody listening for that event on the same
 -- connection will not receive it (!!).
-local logger = require("tch.logger")
 local conn
 local event_conn
 do
@@ -49,14 +103,38 @@ do
   -- override the call() method to be able to log a message when
   -- a timeout happens
   local call = __index.call
-  __index.call = function(_, path, method, ...)
+  local function timed_call(_, path, method, ...)
+    local start = metrics.enabled and now()
     local ret, rv = call(conn, path, method, ...)
+    if start then
+      record("ubus", path .. " " .. method, now() - start)
+    end
     -- Check ubusmsg.h for the possible return code values
     if not ret and tonumber(rv) == 7 then
       logger:warning("ubus call timeout on calling %s %s. %s", path, method, debug.traceback())
     end
     return ret, rv
   end
+  __index.call = timed_call
+  -- call() whose results are reused within a read request, see above
+  __index.call_cached = function(_, path, method, args)
+    local ttl = cache.ttl
+    if not ttl then
+      return timed_call(conn, path, method, args)
+    end
+    local key = call_key(path, method, args)
+    local entry = cache.results[key]
+    if entry and (ttl == 0 or entry.expires > now()) then
+      cache.hits = cache.hits + 1
+      return entry.result
+    end
+    cache.misses = cache.misses + 1
+    local ret, rv = timed_call(conn, path, method, args)
+    if ret ~= nil then
+      cache.results[key] = { result = ret, expires = ttl > 0 and (now() + ttl) or 0 }
+    end
+    return ret, rv
+  end
   -- override the send() method to
   -- use the dedicated event connection
   local send = __index.send
@@ -73,4 +151,40 @@ function M.connect()
   return conn
 end
 
+--- Function that should be called when Transformer starts handling a request.
+-- @param #number ttl The number of milliseconds the call results stay valid
+--   after the request, or 0 to only use them during the request. Pass nil
+--   for requests that change the datamodel; nothing is remembered then
+--   and earlier results are dropped since the changes can invalidate them.
+function M.start(ttl)
+  if ttl and ttl > 0 then
+    cache.ttl = ttl / 1000
+    local time = now()
+    local results = cache.results
+    for key, entry in pairs(results) do
+      if entry.expires <= time then
+        results[key] = nil
+      end
+    end
+  else
+    cache.ttl = ttl
+    cache.results = {}
+  end
+end
+
+--- Function that should be called when Transformer finished handling a
+-- request, also when handling it failed. Calls made outside of a request
+-- are not cached.
+function M.finish()
+  cache.ttl = nil
+end
+
+metrics.addSource("ubus_cache", function()
+  local entries = 0
+  for _ in pairs(cache.results) do
+    entries = entries + 1
+  end
+  return { hits = cache.hits, misses = cache.misses, entries = entries }
+end)
+
 return M
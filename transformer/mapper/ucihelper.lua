@@ -18,10 +18,12 @@ local uci = require("uci") --doc.ucidoc#doc.ucidoc
 local lfs = require("lfs")
 local crypto = require("tch.crypto")
 local logger = require("tch.logger")
+local metrics = require("transformer.metrics")
 
-local next, error, type, pairs, ipairs = next, error, type, pairs, ipairs
+local next, error, type, pairs, ipairs, pcall = next, error, type, pairs, ipairs, pcall
 local open = io.open
 local match = string.match
+local concat = table.concat
 local tonumber = tonumber
 
 --- A representation of the UCI target on which an action needs to be performed.
@@ -221,6 +223,254 @@ local function invalidate_cursor_health(cursor_to_skip, config, invalidate_check
   end
 end
 
+--- Change notifications.
+-- When the inotify module is available the directories holding the config
+-- files are watched and only the configs for which a change is reported
+-- need to be checked again. Without it, or once a watched directory is
+-- removed, all configs are checked at the start of every transaction.
+-- A directory that doesn't exist yet is not created; its parent is watched
+-- until it appears.
+local change_watch --#table the inotify handle and watches, nil when not watching
+
+--- Check whether an inotify event mask has the given flag set.
+local function has_flag(mask, flag)
+  return flag ~= nil and mask % (2 * flag) >= flag
+end
+
+--- Check all loaded configs again when they are next used.
+local function recheck_all()
+  for _, cached_config in pairs(loaded_configs) do
+    cached_config.checked = false
+  end
+end
+
+--- Watch a config directory, or its parent if it doesn't exist yet.
+-- @return #boolean True if a watch was added.
+local function watch_dir(dir)
+  local handle = change_watch.handle
+  if lfs.attributes(dir, "mode") == "directory" then
+    local wd = handle:addwatch(dir, change_watch.mask)
+    if not wd then
+      return false
+    end
+    change_watch.dirs[wd] = dir
+    return true
+  end
+  local parent, name = match(dir, "^(.*/)([^/]+)/$")
+  local wd = parent and handle:addwatch(parent, change_watch.create_mask)
+  if not wd then
+    return false
+  end
+  local waiting = change_watch.parents[wd] or {}
+  waiting[name] = dir
+  change_watch.parents[wd] = waiting
+  return true
+end
+
+--- Stop using change notifications.
+local function drop_change_watch(reason)
+  logger:warning("%s; checking configs on every transaction", reason)
+  change_watch.handle:close()
+  change_watch = nil
+  recheck_all()
+end
+
+do
+  local ok, inotify = pcall(require, "inotify")
+  if ok then
+    local handle = inotify.init({ blocking = false })
+    if handle then
+      change_watch = {
+        handle = handle,
+        mask = inotify.IN_MODIFY + inotify.IN_CLOSE_WRITE + inotify.IN_CREATE + inotify.IN_DELETE
+               + inotify.IN_MOVED_FROM + inotify.IN_MOVED_TO + inotify.IN_DELETE_SELF + inotify.IN_MOVE_SELF,
+        create_mask = inotify.IN_CREATE + inotify.IN_MOVED_TO,
+        overflow = inotify.IN_Q_OVERFLOW,
+        lost = { inotify.IN_IGNORED, inotify.IN_DELETE_SELF, inotify.IN_MOVE_SELF },
+        dirs = {},  -- watched config directories per watch descriptor
+        parents = {},  -- per watch descriptor the missing directories waited for
+      }
+      for _, dir in ipairs({ conf_dir, state_dir, uci_save_dir }) do
+        if change_watch and not watch_dir(dir) then
+          drop_change_watch("cannot watch " .. dir)
+        end
+      end
+    end
+  end
+end
+
+--- Handle one change notification.
+-- @return #boolean False if the notifications can no longer be relied on.
+local function handle_change(event)
+  local mask = event.mask or 0
+  local wd = event.wd
+  if has_flag(mask, change_watch.overflow) then
+    -- events were lost; everything needs to be checked
+    recheck_all()
+    return true
+  end
+  local dir = change_watch.dirs[wd]
+  for _, flag in ipairs(change_watch.lost) do
+    if has_flag(mask, flag) then
+      if dir or change_watch.parents[wd] then
+        drop_change_watch("stopped watching " .. (dir or "the UCI directories"))
+        return false
+      end
+      -- a parent watch that was removed on purpose
+      return true
+    end
+  end
+  if dir then
+    -- uci writes '.<config>.uci-XXXXXX' files and renames them; let the
+    -- verifiers decide whether the config really changed
+    local cached_config = event.name and loaded_configs[event.name]
+    if cached_config then
+      cached_config.checked = false
+    end
+    return true
+  end
+  local waiting = change_watch.parents[wd]
+  local created = waiting and event.name and waiting[event.name]
+  if created then
+    waiting[event.name] = nil
+    if not next(waiting) then
+      change_watch.parents[wd] = nil
+      change_watch.handle:rmwatch(wd)
+    end
+    if not watch_dir(created) then
+      drop_change_watch("cannot watch " .. created)
+      return false
+    end
+    recheck_all()
+  end
+  return true
+end
+
+--- Read the pending change notifications and mark the changed configs to be
+-- checked again.
+-- @return #boolean True if change notifications are used, false otherwise.
+local function process_changes()
+  while change_watch do
+    local events = change_watch.handle:read()
+    if type(events) ~= "table" or not events[1] then
+      return true
+    end
+    for _, event in ipairs(events) do
+      if not handle_change(event) then
+        return false
+      end
+    end
+  end
+  return false
+end
+
+--- Loaded config cache.
+-- The configs loaded in `cursor`, `state_cursor` and `foreach_cursor` are
+-- kept in one list ordered from most to least recently used. With a memory
+-- budget set, the least recently used configs are unloaded when the
+-- estimated size of all loaded configs exceeds it. The size of a loaded
+-- config is estimated by the size of its files.
+-- Unloading is safe: changes are always saved to the save dir right away.
+local config_cache = {
+  budget = 0,  -- in bytes, 0 means unbounded
+  size = 0,
+  entries = 0,
+  hits = 0,
+  misses = 0,
+  evictions = 0,
+  nodes = {},  -- nodes[cursor][config] = node
+  -- sentinel of the circular list; head.next is the most recently used
+  head = {},
+}
+config_cache.head.next = config_cache.head
+config_cache.head.prev = config_cache.head
+
+local function unlink_node(node)
+  node.prev.next = node.next
+  node.next.prev = node.prev
+end
+
+local function link_node_first(node)
+  local head = config_cache.head
+  node.next = head.next
+  node.prev = head
+  head.next.prev = node
+  head.next = node
+end
+
+local function config_size(cursor_to_size, config)
+  local size = (lfs.attributes(conf_dir..config, "size") or 0)
+             + (lfs.attributes(uci_save_dir..config, "size") or 0)
+             + (lfs.attributes(save_dir..config, "size") or 0)
+  if cursor_to_size == state_cursor then
+    size = size + (lfs.attributes(state_dir..config, "size") or 0)
+  end
+  return size
+end
+
+local function remove_node(node)
+  unlink_node(node)
+  config_cache.nodes[node.cursor][node.config] = nil
+  config_cache.size = config_cache.size - node.size
+  config_cache.entries = config_cache.entries - 1
+end
+
+--- Unload least recently used configs until the cache fits its budget.
+-- @param keep A node that must stay loaded (optional).
+local function evict_configs(keep)
+  local budget = config_cache.budget
+  if budget <= 0 then
+    return
+  end
+  local head = config_cache.head
+  local node = head.prev
+  while config_cache.size > budget and node ~= head do
+    local prev = node.prev
+    -- never unload a config from under a foreach loop
+    if node ~= keep and not cursors_in_foreach[node.cursor] then
+      node.cursor:unload(node.config)
+      local cached_config = loaded_configs[node.config]
+      if cached_config then
+        cached_config.cursor_health[node.cursor] = false
+      end
+      remove_node(node)
+      config_cache.evictions = config_cache.evictions + 1
+    end
+    node = prev
+  end
+end
+
+--- Record that a config was (re)loaded in a cursor.
+local function cache_loaded(cursor_loaded, config)
+  local nodes = config_cache.nodes[cursor_loaded]
+  if not nodes then
+    nodes = {}
+    config_cache.nodes[cursor_loaded] = nodes
+  end
+  local node = nodes[config]
+  if node then
+    remove_node(node)
+  end
+  node = { cursor = cursor_loaded, config = config, size = config_size(cursor_loaded, config) }
+  nodes[config] = node
+  link_node_first(node)
+  config_cache.size = config_cache.size + node.size
+  config_cache.entries = config_cache.entries + 1
+  config_cache.misses = config_cache.misses + 1
+  evict_configs(node)
+end
+
+--- Record that a loaded config was used.
+local function cache_used(cursor_used, config)
+  local nodes = config_cache.nodes[cursor_used]
+  local node = nodes and nodes[config]
+  if node then
+    unlink_node(node)
+    link_node_first(node)
+  end
+  config_cache.hits = config_cache.hits + 1
+end
+
 --- Helper function to reload a given config on the given cursor.
 -- The config will first be unloaded and then loaded in the given cursor. We will
 -- then update the internal bookkeeping of our cursors for this configuration file.
@@ -273,6 +523,7 @@ local function reload_cursor(cursor_to_reload, config)
     cached_config.checked = true
   end
   cached_config.cursor_health[cursor_to_reload] = true
+  cache_loaded(cursor_to_reload, config)
   return true
 end
 
@@ -319,6 +570,53 @@ local function trace_binding(binding, fn_name, cursor_to_trace)
   logger:debug(log_msg)
 end
 
+-- The configs of which the commit is deferred until flush_commits() is
+-- called, with the number of commits that were asked for each of them.
+-- It's nil while commits are done immediately.
+local deferred_commits
+-- Likewise the configs of which the commit of the generated keys is deferred.
+local deferred_keys
+
+local function commit_config(config)
+  metrics.add("uci_commit", config)
+  local result = commit_cursor(cursor, config)
+  if not result then
+    logger:error("commit of %s failed", config)
+  end
+  return result
+end
+
+local function commit_config_keys(config)
+  local rc = keycursor:commit(config)
+  invalidate_cursor_health(nil, config, true)
+  keycursor:unload(config)
+  if not rc then
+    logger:error("commit of the keys of %s failed", config)
+  end
+  return rc
+end
+
+-- A config of which the commit is deferred is committed before it's changed
+-- again, so the new change is not committed along with the earlier ones.
+local function commit_deferred(config)
+  if deferred_commits and deferred_commits[config] then
+    deferred_commits[config] = nil
+    commit_config(config)
+  end
+end
+
+-- The deferred keys of a config are committed before it's read or keys are
+-- generated for it again, so the keys aren't missed and generated twice.
+local function commit_deferred_keys(config)
+  if deferred_keys and deferred_keys[config] then
+    deferred_keys[config] = nil
+    commit_config_keys(config)
+  end
+end
+
+-- The function told about the config files that are read, see observe_reads().
+local read_observer
+
 --- Function that refreshes the given cursor.
 -- It will first check if the given cursor needs to be refreshed and only refresh when needed.
 -- @param #binding binding The binding representing the location of the config in uci.
@@ -328,9 +626,17 @@ end
 local function refresh_cursor(binding, cursor)
   --trace_binding(binding, "refresh_cursor", cursor)
   local config = binding.config
+  commit_deferred_keys(config)
+  if read_observer then
+    read_observer(conf_dir..config)
+    if cursor == state_cursor then
+      read_observer(state_dir..config)
+    end
+  end
   if check_cursor_config_needs_update(cursor, config) then
     return reload_cursor(cursor, config)
   end
+  cache_used(cursor, config)
   return true
 end
 
@@ -338,10 +644,12 @@ end
 -- @param #binding binding The binding representing the location of the config in UCI.
 --                 This binding should contain at least 1 named table entry: config
 local function commit_keys(binding)
-  local rc = keycursor:commit(binding.config)
-  invalidate_cursor_health(nil, binding.config, true)
-  keycursor:unload(binding.config)
-  return rc
+  local config = binding.config
+  if deferred_keys then
+    deferred_keys[config] = true
+    return true
+  end
+  return commit_config_keys(config)
 end
 
 M.commit_keys = commit_keys
@@ -387,11 +695,73 @@ local function get_section_type(binding, value)
 end
 
 --- Function that commits the changes made to the given config
+-- The config is written before this function returns.
 -- @param #binding binding The binding representing the location of the parameter in uci.
 --                 This binding should contain at least 1 named table entry: config
 function M.commit(binding)
   --trace_binding(binding, "commit")
-  return commit_cursor(cursor, binding.config)
+  local config = binding.config
+  if deferred_commits then
+    -- this commit includes the deferred one
+    deferred_commits[config] = nil
+  end
+  return commit_config(config)
+end
+
+--- Function that commits the changes made to the given config, possibly later.
+-- While the commits are deferred (see defer_commits()) the config is only
+-- written by flush_commits(), so only use this when nothing relies on the
+-- config being written when it returns. The generic UCI mappers use it.
+-- @param #binding binding The binding representing the location of the parameter in uci.
+--                 This binding should contain at least 1 named table entry: config
+function M.commit_grouped(binding)
+  local config = binding.config
+  if deferred_commits then
+    deferred_commits[config] = (deferred_commits[config] or 0) + 1
+    return true
+  end
+  return commit_config(config)
+end
+
+--- Function that defers the grouped commits and the commits of the
+-- generated keys until flush_commits() is called.
+-- Mappings commit their changes separately, so when a transaction changed
+-- several parameters of the same config it would be written several times.
+-- While the commits are deferred each config is only written once.
+function M.defer_commits()
+  deferred_commits = deferred_commits or {}
+  deferred_keys = deferred_keys or {}
+end
+
+--- Function that commits every config of which the commit was deferred.
+-- Commits are done immediately again afterwards.
+-- @return #boolean True if all configs were committed, nil + error message
+--   naming the configs that failed otherwise.
+function M.flush_commits()
+  local pending, pending_keys = deferred_commits, deferred_keys
+  deferred_commits, deferred_keys = nil, nil
+  local failed = {}
+  if pending_keys then
+    for config in pairs(pending_keys) do
+      if not commit_config_keys(config) then
+        failed[#failed + 1] = config
+      end
+    end
+  end
+  if pending then
+    for config, requested in pairs(pending) do
+      if requested > 1 then
+        metrics.add("uci_commit_merged", config, requested - 1)
+      end
+      if not commit_config(config) then
+        failed[#failed + 1] = config
+      end
+    end
+  end
+  if failed[1] then
+    return nil, "commit of " .. concat(failed, ", ") .. " failed"
+  end
+  return true
 end
 
 --- Function which gets a parameter from uci
@@ -504,6 +874,7 @@ function M.set_on_uci(binding, value, commitapply)
   if not value then
     error("No value given to be set on UCI", 2)
   end
+  commit_deferred(config)
   local result = refresh_cursor(binding, cursor)
   local errmsg
   if result then
@@ -592,6 +963,7 @@ function M.add_on_uci(binding, commitapply)
   if not section then
     error("No section type could be found in the given binding", 2)
   end
+  commit_deferred(config)
   local result = refresh_cursor(binding, cursor)
   local errmsg
   if result then
@@ -631,6 +1003,7 @@ function M.delete_on_uci(binding, commitapply)
   if not section then
     error("No section name could be found in the given binding", 2)
   end
+  commit_deferred(config)
   local result = refresh_cursor(binding, cursor)
   if result then
     if binding.extended then
@@ -685,6 +1058,7 @@ function M.reorder_on_uci(binding, index, commitapply)
   if not (type(index) == "number") then
     error("Index must be a number", 2)
   end
+  commit_deferred(config)
   local result = refresh_cursor(binding, cursor)
   if result then
     if binding.extended then
@@ -752,6 +1126,7 @@ function M.revert(binding)
   if not config then
     error("No config could be found in the given binding", 2)
   end
+  commit_deferred(config)
   local result = cursor:revert(config)
   if result then
     -- Since we don't know what is being reverted, invalidate all caches.
@@ -789,6 +1164,7 @@ function M.generate_key_on_uci(binding, key)
   if not section then
     error("No sectionname could be found in the given binding", 2)
   end
+  commit_deferred_keys(config)
   key = key or M.generate_key()
   -- For performance reasons we do not save; all changes are kept
   -- in memory. The assumption is that several keys are generated and
@@ -805,16 +1181,73 @@ end
 -- This function will wipe the state of the cached entries, forcing the cache
 -- to be validated before being used again. Once the cache is validated, it will
 -- not be checked again until the next time the state is cleared.
+-- When change notifications are available only the configs that were
+-- reported as changed are wiped.
 function M.start()
-  for config, config_status in pairs(loaded_configs) do
-    config_status.checked = false
+  if not process_changes() then
+    for config, config_status in pairs(loaded_configs) do
+      config_status.checked = false
+    end
   end
   cursors_in_foreach = {}
 end
 
+--- Get the file descriptor on which config change notifications arrive.
+-- Watch it in the event loop and call `process_changes` when it's readable
+-- and no request is being processed, so the notifications don't pile up
+-- while no requests are coming in.
+-- @return #number The file descriptor or nil if changes aren't watched.
+function M.change_fd()
+  if change_watch then
+    return change_watch.handle:fileno()
+  end
+end
+
+--- Read the pending config change notifications.
+-- @return #boolean True if change notifications are still used; if not the
+--   file descriptor returned by `change_fd` is closed.
+function M.process_changes()
+  return process_changes()
+end
+
+--- Set a function that is called with the path of every config file that
+-- is read through the helper.
+-- The map loader uses it to learn which configs a map file reads while it
+-- registers its mappings.
+-- @param #function observer The function or nil to stop observing.
+function M.observe_reads(observer)
+  read_observer = observer
+end
+
+--- Set the memory budget for the loaded UCI configs.
+-- When the configs loaded by all cursors together are estimated to take
+-- more, the least recently used ones are unloaded.
+-- @param #number budget The budget in bytes; 0 or nil means unbounded.
+function M.set_cache_budget(budget)
+  config_cache.budget = budget or 0
+  evict_configs()
+end
+
+--- Retrieve the statistics of the loaded config cache.
+-- @return #table A table with the `budget`, the estimated `size` in bytes,
+--   the number of loaded configs (`entries`) and the `hits`, `misses` and
+--   `evictions` counters.
+function M.cache_stats()
+  return {
+    budget = config_cache.budget,
+    size = config_cache.size,
+    entries = config_cache.entries,
+    hits = config_cache.hits,
+    misses = config_cache.misses,
+    evictions = config_cache.evictions,
+  }
+end
+
 -- Preload the UCI config during startup. We only do it for the state_cursor,
 -- since preloading the other cursors costs more then 1 MB of memory and only has
 -- a small performance gain (0.3 seconds on the entire UCI datamodel)
+-- When a cache budget is set afterwards the configs that don't fit are
+-- unloaded again.
 for _, file in ipairs(state_cursor:list_configs() or {}) do
   reload_cursor(state_cursor, file)
 end
@@ -185,7 +185,7 @@ end
 
 --- A generic commit function for a mapping.
 local function commit(mapping)
-  return do_transaction(uci_helper.commit, mapping)
+  return do_transaction(uci_helper.commit_grouped, mapping)
 end
 
 --- A generic revert function for a mapping.
@@ -0,0 +1,188 @@
+--[[
+Copyright (c) 2016 Technicolor Delivery Technologies, SAS
+
+The source code form of this Transformer component is subject
+to the terms of the Clear BSD license.
+
+You can redistribute it and/or modify it under the terms of the
+Clear BSD License (http://directory.fsf.org/wiki/License:ClearBSD)
+
+See LICENSE file for more details.
+]]
+
+--- Counters and latency histograms of the Transformer server.
+-- Measurements are kept per group (e.g. "get" for the getters) and per name
+-- within that group (e.g. the typepath of the mapping). Every series holds
+-- the number of measurements, their total and maximum duration and a
+-- histogram with one bucket per decade, from 100 microseconds to 1 second.
+-- The instrumented code checks `M.enabled` before it takes a time stamp so
+-- nothing is measured while the metrics are disabled and no listener is set.
+-- @module transformer.metrics
+local M = {
+  enabled = false,
+}
+
+local pairs, pcall, require, sort, floor, type =
+      pairs, pcall, require, table.sort, math.floor, type
+
+-- Prefer a monotonic wall clock so the time spent waiting on other
+-- processes (ubus, fsync, ...) is included.
+local now = os.clock
+do
+  local ok, posix = pcall(require, "tch.posix")
+  if ok and posix.clock_gettime and posix.CLOCK_MONOTONIC then
+    local clock_gettime, monotonic = posix.clock_gettime, posix.CLOCK_MONOTONIC
+    now = function()
+      local sec, nsec = clock_gettime(monotonic)
+      return sec + nsec / 1e9
+    end
+  end
+end
+
+--- Retrieve the current time in seconds.
+M.now = now
+
+-- upper bounds (in seconds) of the histogram buckets; the last
+-- bucket takes everything above
+local bounds = { 1e-4, 1e-3, 1e-2, 1e-1, 1 }
+local nbuckets = #bounds + 1
+
+local groups = {}
+local sources = {}
+-- true if the measurements are kept
+local collecting = false
+-- function that is told about every measured duration
+local listener
+
+local function update_enabled()
+  M.enabled = collecting or (listener ~= nil)
+end
+
+local function get_series(group, name)
+  local series = groups[group]
+  if not series then
+    series = {}
+    groups[group] = series
+  end
+  local s = series[name]
+  if not s then
+    s = { count = 0, total = 0, max = 0 }
+    for i = 1, nbuckets do
+      s[i] = 0
+    end
+    series[name] = s
+  end
+  return s
+end
+
+--- Record a measured duration.
+-- @param #string group The group of the measurement.
+-- @param #string name The name of the series within the group.
+-- @param #number elapsed The duration in seconds.
+function M.record(group, name, elapsed)
+  if listener then
+    listener(group, name, elapsed)
+  end
+  if not collecting then
+    return
+  end
+  local s = get_series(group, name)
+  s.timed = true
+  s.count = s.count + 1
+  s.total = s.total + elapsed
+  if elapsed > s.max then
+    s.max = elapsed
+  end
+  local i = 1
+  while i < nbuckets and elapsed > bounds[i] do
+    i = i + 1
+  end
+  s[i] = s[i] + 1
+end
+
+--- Increment a counter.
+-- @param #string group The group of the counter.
+-- @param #string name The name of the counter within the group.
+-- @param #number n (optional) The increment; defaults to 1.
+function M.add(group, name, n)
+  if not collecting then
+    return
+  end
+  local s = get_series(group, name)
+  s.count = s.count + (n or 1)
+end
+
+--- Add a source of counters that are maintained elsewhere.
+-- @param #string group The group under which the counters are reported.
+-- @param #function source A function returning a table with numeric
+--   counters; other fields are ignored. Fractions are dropped.
+function M.addSource(group, source)
+  sources[group] = source
+end
+
+--- Enable or disable the measurements.
+-- @param #boolean enabled True to enable them.
+function M.enable(enabled)
+  collecting = (enabled == true)
+  update_enabled()
+end
+
+--- Set a function that is called with the group, name and duration of
+-- every measurement, also when the measurements are not kept.
+-- @param #function fn The function or nil to remove it.
+function M.setListener(fn)
+  listener = fn
+  update_enabled()
+end
+
+--- Forget all measurements.
+function M.reset()
+  groups = {}
+end
+
+local function to_us(seconds)
+  return floor(seconds * 1e6 + 0.5)
+end
+
+--- Retrieve all measurements and the counters of the sources.
+-- @return #table An array, sorted on group and name, of tables with `group`,
+--   `name` and `count` fields. Durations have `total` and `max` fields in
+--   microseconds and a `buckets` array with the histogram.
+function M.snapshot()
+  local result = {}
+  for group, series in pairs(groups) do
+    for name, s in pairs(series) do
+      local entry = { group = group, name = name, count = s.count }
+      if s.timed then
+        entry.total = to_us(s.total)
+        entry.max = to_us(s.max)
+        local buckets = {}
+        for i = 1, nbuckets do
+          buckets[i] = s[i]
+        end
+        entry.buckets = buckets
+      end
+      result[#result + 1] = entry
+    end
+  end
+  for group, source in pairs(sources) do
+    local ok, counters = pcall(source)
+    if ok and type(counters) == "table" then
+      for name, value in pairs(counters) do
+        if type(value) == "number" then
+          -- counters are reported as integers
+          result[#result + 1] = { group = group, name = name, count = floor(value) }
+        end
+      end
+    end
+  end
+  sort(result, function(a, b)
+    if a.group ~= b.group then
+      return a.group < b.group
+    end
+    return a.name < b.name
+  end)
+  return result
+end
+
+return M
@@ -41,6 +41,12 @@ local GPC_REQ = 22
 local GPC_RESP = 23
 local GPV_NO_ABORT_REQ = 24
 local GPV_NO_ABORT_RESP = 25
+local EVENTS = 26
+local GPV_DELTA_REQ = 27
+local GPV_DELTA_RESP = 28
+local GPV_FILTER_REQ = 29
+local METRICS_REQ = 30
+local METRICS_RESP = 31
 
 
 -------------------------------------------------------------
@@ -205,7 +211,10 @@ Msg.tags = {
   -- * 2 bytes (big endian) for the length of following string.
   -- * string representing the abstract Unix domain socket address.
   -- * 1 byte for the subscription type (bitwise OR of ADD, DEL and UPDATE).
-  -- * 1 byte to pass more options (no_own_events, active, current_instances_only)
+  -- * 1 byte to pass more options (no_own_events, active, current_instances_only,
+  --   batch_events)
+  -- * (optional) 2 bytes (big endian) for the minimum interval in milliseconds
+  --   between two deliveries of events for this subscription.
   SUBSCRIBE_REQ = SUBSCRIBE_REQ,
   --- Subscribe response messages consist of (excluding tag byte):
   -- * 2 bytes (big endian) for the subscription ID number
@@ -225,6 +234,10 @@ Msg.tags = {
   -- * 2 bytes (big endian) for the length of following string.
   -- * string representing the path that caused the event.
   -- * 1 byte for the event type (bitwise or of ADD, DEL and UPDATE).
+  --   An event type of 0 is a resync event: events were dropped and the
+  --   subscriber should reread the paths of all its subscriptions. Such an
+  --   event has subscription ID 0 (never used for a subscription) and an
+  --   empty path.
   -- * (optional) 2 bytes for the length of following string.
   -- * (optional) string representing the new changed value.
   EVENT = EVENT,
@@ -256,7 +269,7 @@ Msg.tags = {
   -- Decoding such a message returns an array of the paths.
   GPC_REQ = GPC_REQ,
   --- GetParameterCount response message consists of (excluding tag byte)
-  -- * 2 bytes (big endian) for the number of parameters
+  -- * 4 bytes (big endian) for the number of parameters
   -- To encode such a message you provide a number in a
   -- call to msg.encode().
   -- Decoding such a message returns a number.
@@ -285,6 +298,92 @@ Msg.tags = {
   -- Decoding such a message returns an array of tables
   -- with 'path', 'param', 'value' and 'type' fields.
   GPV_NO_ABORT_RESP = GPV_NO_ABORT_RESP,
+  --- Events messages carry several events for subscriptions that asked for
+  -- batched delivery. They consist of (excluding tag byte) one or more sets
+  -- of the following:
+  -- * 2 bytes (big endian) for the subscription ID number.
+  -- * 2 bytes (big endian) for the length of following string.
+  -- * string representing the path that caused the event.
+  -- * 1 byte for the event type (bitwise or of ADD, DEL and UPDATE).
+  -- * 2 bytes for the length of following string.
+  -- * string representing the new changed value.
+  -- To encode such a message you provide the same values as for an EVENT
+  -- message in each call to msg.encode().
+  -- Decoding such a message returns an array of tables with 'id', 'path',
+  -- 'eventmask' and 'value' fields.
+  EVENTS = EVENTS,
+  --- GPV Delta request message consists of (excluding tag byte and
+  -- identification bytes):
+  -- * 2 bytes (big endian) for length of following string
+  -- * string representing the change token returned by an earlier
+  --   GPV Delta request; empty to retrieve all values
+  -- followed by one or more sets of the following:
+  -- * 2 bytes (big endian) for length of following string
+  -- * string representing path to retrieve
+  -- To encode such a message you first provide the token and then
+  -- one path in each call to msg.encode().
+  -- Decoding such a message returns an array of the paths with
+  -- the token in the 'token' field.
+  GPV_DELTA_REQ = GPV_DELTA_REQ,
+  --- GPV Delta response message consists of (excluding tag byte)
+  -- one or more records, each starting with 1 byte for the record
+  -- kind followed by:
+  -- * for a changed parameter (kind 0): the path to the object, the
+  --   parameter name, value and type, each as 2 bytes (big endian)
+  --   length followed by the string;
+  -- * for a deleted object (kind 1): 2 bytes length and the string
+  --   representing the path of the object;
+  -- * for the change token (kind 2, always the last record): 2 bytes
+  --   length and the token string, followed by 1 byte that is 1 if
+  --   all values were reported (the given token was unknown or
+  --   expired) and 0 otherwise.
+  -- To encode such a message you provide the kind followed by the
+  -- values of the record in each call to msg.encode().
+  -- Decoding such a message returns an array of tables with either
+  -- 'path', 'param', 'value' and 'type' fields, a 'deleted' field or
+  -- 'token' and 'full' fields.
+  GPV_DELTA_RESP = GPV_DELTA_RESP,
+  --- GPV Filter request message consists of (excluding tag byte and
+  -- identification bytes):
+  -- * 2 bytes (big endian) for length of following string
+  -- * string representing the filter expression; empty for no filter
+  -- * 2 bytes (big endian) for length of following string
+  -- * string with the comma separated names of the parameters to
+  --   return; empty for all parameters
+  -- followed by one or more sets of the following:
+  -- * 2 bytes (big endian) for length of following string
+  -- * string representing path to retrieve
+  -- To encode such a message you first provide the filter, then the
+  -- parameter names and then one path in each call to msg.encode().
+  -- Decoding such a message returns an array of the paths with the
+  -- filter in the 'filter' field and an array of the parameter names
+  -- in the 'params' field.
+  -- The response is a GPV response message.
+  GPV_FILTER_REQ = GPV_FILTER_REQ,
+  --- Metrics request message consists of (excluding tag byte and
+  -- identification bytes):
+  -- * 1 byte that is 1 if the measurements must be cleared after
+  --   retrieving them and 0 otherwise
+  -- To encode such a message you provide a boolean in a call to
+  -- msg.encode().
+  -- Decoding such a message returns a table with a 'reset' field.
+  METRICS_REQ = METRICS_REQ,
+  --- Metrics response message consists of (excluding tag byte)
+  -- one or more sets of the following:
+  -- * 2 bytes (big endian) for length of following string
+  -- * string representing the group of the measurement
+  -- * 2 bytes length
+  -- * string representing the name of the measurement
+  -- * 2 bytes length
+  -- * string with the space separated decimal numbers of the
+  --   measurement: the count, optionally followed by the total and
+  --   maximum duration in microseconds and the histogram buckets
+  -- To encode such a message you provide a table as returned by
+  -- metrics.snapshot() in each call to msg.encode().
+  -- Decoding such a message returns an array of tables with 'group',
+  -- 'name' and 'count' fields and, for durations, 'total', 'max' and
+  -- 'buckets' fields.
+  METRICS_RESP = METRICS_RESP,
 }
 
 Msg.header_length = 1
@@ -380,6 +479,12 @@ local function load_functions(coder)
   result[GPC_RESP] = coder.GPC_RESP
   result[GPV_NO_ABORT_REQ] = coder.GPV_NO_ABORT_REQ
   result[GPV_NO_ABORT_RESP] = coder.GPV_NO_ABORT_RESP
+  result[EVENTS] = coder.EVENTS
+  result[GPV_DELTA_REQ] = coder.GPV_DELTA_REQ
+  result[GPV_DELTA_RESP] = coder.GPV_DELTA_RESP
+  result[GPV_FILTER_REQ] = coder.GPV_FILTER_REQ
+  result[METRICS_REQ] = coder.METRICS_REQ
+  result[METRICS_RESP] = coder.METRICS_RESP
   return result
 end
 
@@ -11,7 +11,8 @@ See LICENSE file for more details.
 ]]
 
 local setmetatable, require = setmetatable, require
-local byte, sub = string.byte, string.sub
+local byte, sub, gmatch, find, format = string.byte, string.sub, string.gmatch, string.find, string.format
+local tonumber, error = tonumber, error
 
 local Decoder = {}
 Decoder.__index = Decoder
@@ -19,7 +20,8 @@ Decoder.__index = Decoder
 local function isRequest(self, tag)
   if tag == self.tags["GPV_REQ"] or tag == self.tags["SPV_REQ"] or tag == self.tags["APPLY"] or tag == self.tags["ADD_REQ"]
      or tag == self.tags["DEL_REQ"] or tag == self.tags["GPN_REQ"] or tag == self.tags["RESOLVE_REQ"] or tag == self.tags["SUBSCRIBE_REQ"]
-     or tag == self.tags["UNSUBSCRIBE_REQ"] or tag == self.tags["GPL_REQ"] or tag == self.tags["GPC_REQ"] or tag == self.tags["GPV_NO_ABORT_REQ"] then
+     or tag == self.tags["UNSUBSCRIBE_REQ"] or tag == self.tags["GPL_REQ"] or tag == self.tags["GPC_REQ"] or tag == self.tags["GPV_NO_ABORT_REQ"]
+     or tag == self.tags["GPV_DELTA_REQ"] or tag == self.tags["GPV_FILTER_REQ"] or tag == self.tags["METRICS_REQ"] then
     return true
   end
   return false
@@ -198,6 +200,21 @@ function Decoder:EVENT()
   return { id = subid, path = path, eventmask = event_type, value = value}
 end
 
+--- Decodes an EVENTS message consisting of one or more events.
+-- @return #table An array of tables with 'id', 'path', 'eventmask' and 'value' fields.
+function Decoder:EVENTS()
+  local data = {}
+  while (self.index < self.msglength) do
+    local subid, path, event_type, value
+    subid = decode_number(self)
+    path = decode_string(self)
+    event_type = decode_byte(self)
+    value = decode_string(self)
+    data[#data + 1] = { id = subid, path = path, eventmask = event_type, value = value }
+  end
+  return data
+end
+
 --- Decodes a GPL_RESP message consisting of a path and name.
 -- @return #table An array of tables with 'path' and 'param' fields.
 function Decoder:GPL_RESP()
@@ -214,13 +231,73 @@ end
 --- Decodes a GPC_RESP message consisting of a number.
 -- @return #number The decoded number of parameters.
 function Decoder:GPC_RESP()
-  return decode_number(self)
+  local hi = decode_number(self)
+  return hi * 65536 + decode_number(self)
 end
 
 --- Decodes a GPV_NO_ABORT_RESP message consisting of a path, name, value and type.
 -- @return #table An array of tables with 'path', 'param', 'value' and 'type' fields.
 Decoder.GPV_NO_ABORT_RESP = Decoder.GPV_RESP
 
+--- Decodes a GPV_DELTA_RESP message consisting of one or more records.
+-- @return #table An array of tables with either 'path', 'param', 'value'
+--   and 'type' fields for a changed parameter, a 'deleted' field for a
+--   deleted object or 'token' and 'full' fields for the change token.
+function Decoder:GPV_DELTA_RESP()
+  local data = {}
+  while (self.index < self.msglength) do
+    local kind = decode_byte(self)
+    if kind == 0 then
+      local path, param, value, ptype
+      path = decode_string(self)
+      param = decode_string(self)
+      value = decode_string(self)
+      ptype = decode_string(self)
+      data[#data + 1] = { path = path, param = param, value = value, type = ptype }
+    elseif kind == 1 then
+      data[#data + 1] = { deleted = decode_string(self) }
+    else
+      local token = decode_string(self)
+      data[#data + 1] = { token = token, full = (decode_byte(self) == 1) }
+    end
+  end
+  return data
+end
+
+--- Decodes a METRICS_RESP message consisting of one or more measurements.
+-- @return #table An array of tables with 'group', 'name' and 'count' fields
+--   and, for durations, 'total', 'max' and 'buckets' fields.
+-- or raises an error if a measurement has values that aren't unsigned
+-- integers or a duration lacks its total or maximum.
+function Decoder:METRICS_RESP()
+  local data = {}
+  while (self.index < self.msglength) do
+    local m = { group = decode_string(self), name = decode_string(self) }
+    local values = {}
+    for value in gmatch(decode_string(self), "%S+") do
+      if not find(value, "^%d+$") then
+        error(format("invalid value '%s' for %s %s", value, m.group, m.name), 0)
+      end
+      values[#values + 1] = tonumber(value)
+    end
+    if not values[1] or (values[2] and not values[3]) then
+      error(format("incomplete values for %s %s", m.group, m.name), 0)
+    end
+    m.count = values[1]
+    if values[2] then
+      m.total = values[2]
+      m.max = values[3]
+      local buckets = {}
+      for i = 4, #values do
+        buckets[#buckets + 1] = values[i]
+      end
+      m.buckets = buckets
+    end
+    data[#data + 1] = m
+  end
+  return data
+end
+
 ----------------------
 -- Request messages --
 ----------------------
@@ -290,15 +367,20 @@ function Decoder:RESOLVE_REQ()
 end
 
 --- Decodes a SUBSCRIBE_REQ message consisting of a path, socket address,
--- subscription type mask and options mask.
--- @return #table A table with 'path', 'address', 'subscription' and 'options' fields.
+-- subscription type mask, options mask and optional minimum interval.
+-- @return #table A table with 'path', 'address', 'subscription', 'options' and
+--                'min_interval' fields.
 function Decoder:SUBSCRIBE_REQ()
-  local path, domainsock, subscr, options
+  local path, domainsock, subscr, options, min_interval
   path = decode_string(self)
   domainsock = decode_string(self)
   subscr = decode_byte(self)
   options = decode_byte(self)
-  return { path = path, address = domainsock, subscription = subscr, options = options }
+  if (self.index < self.msglength) then
+    min_interval = decode_number(self)
+  end
+  return { path = path, address = domainsock, subscription = subscr, options = options,
+           min_interval = min_interval }
 end
 
 --- Decodes a UNSUBSCRIBE_REQ message consisting of a subscription id.
@@ -331,6 +413,42 @@ end
 -- @return #table An array of paths.
 Decoder.GPV_NO_ABORT_REQ = Decoder.GPV_REQ
 
+--- Decodes a GPV_DELTA_REQ message consisting of a token and one or more paths.
+-- @return #table An array of paths with the token in the 'token' field.
+function Decoder:GPV_DELTA_REQ()
+  local data = { token = decode_string(self) }
+  while (self.index < self.msglength) do
+    data[#data + 1] = decode_string(self)
+  end
+  return data
+end
+
+--- Decodes a GPV_FILTER_REQ message consisting of a filter, parameter names
+-- and one or more paths.
+-- @return #table An array of paths with the filter in the 'filter' field and
+--   an array of parameter names in the 'params' field.
+function Decoder:GPV_FILTER_REQ()
+  local data = { filter = decode_string(self), params = {} }
+  local params = data.params
+  for name in gmatch(decode_string(self), "[^,%s]+") do
+    params[#params + 1] = name
+  end
+  while (self.index < self.msglength) do
+    data[#data + 1] = decode_string(self)
+  end
+  return data
+end
+
+--- Decodes a METRICS_REQ message consisting of the reset flag.
+-- @return #table A table with a 'reset' field.
+function Decoder:METRICS_REQ()
+  local reset = false
+  if (self.index <= self.msglength) then
+    reset = (decode_byte(self) == 1)
+  end
+  return { reset = reset }
+end
+
 --- Initialize the decoder environment to start decoding.
 -- @param #string msg The message that needs to be decoded.
 -- @return #string, #boolean, #string
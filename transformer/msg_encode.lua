@@ -13,6 +13,7 @@ See LICENSE file for more details.
 local floor = math.floor
 local char, sub, byte = string.char, string.sub, string.byte
 local ipairs, setmetatable, tonumber = ipairs, setmetatable, tonumber
+local concat = table.concat
 
 local Encoder = {}
 Encoder.__index = Encoder
@@ -199,6 +200,20 @@ function Encoder:EVENT(subid, path, event_type, value)
   return confirm_encoding(self)
 end
 
+--- Encodes one event of an EVENTS message consisting of a subscription ID,
+-- a path string, event type and changed value.
+-- @param #number subid The subscription ID to be encoded.
+-- @param #string path The path that generated the event.
+-- @param #number event_type The event type mask.
+-- @param #string value The new value of the changed path.
+function Encoder:EVENTS(subid, path, event_type, value)
+  encode_number(self, subid)
+  encode_string(self, path)
+  encode_byte(self, event_type)
+  encode_string(self, value or "")
+  return confirm_encoding(self)
+end
+
 --- Encodes a GPL_RESP message consisting of a path and name.
 -- @param #string ppath The path to be encoded.
 -- @param #string pname The parameter name to be encoded.
@@ -209,9 +224,14 @@ function Encoder:GPL_RESP(ppath, pname)
 end
 
 --- Encodes a GPC_RESP message consisting of the count of parameters.
--- @param #number ppcount The number of parameters.
+-- @param #number pcount The number of parameters; larger counts than
+--   fit in 32 bits are clamped.
 function Encoder:GPC_RESP(pcount)
-  encode_number(self, pcount)
+  if pcount > 0xFFFFFFFF then
+    pcount = 0xFFFFFFFF
+  end
+  encode_number(self, floor(pcount / 65536))
+  encode_number(self, pcount % 65536)
   return confirm_encoding(self)
 end
 
@@ -222,6 +242,48 @@ end
 -- @param #string ptype The parameter type to be encoded.
 Encoder.GPV_NO_ABORT_RESP = Encoder.GPV_RESP
 
+--- Encodes one record of a GPV_DELTA_RESP message.
+-- @param #number kind The kind of record: 0 for a changed parameter,
+--   1 for a deleted object and 2 for the change token.
+-- @param ... For a changed parameter the path, name, value and type;
+--   for a deleted object its path; for the change token the token and
+--   a boolean that is true if all values were reported.
+function Encoder:GPV_DELTA_RESP(kind, ...)
+  encode_byte(self, kind)
+  if kind == 0 then
+    local ppath, pname, pvalue, ptype = ...
+    encode_string(self, ppath)
+    encode_string(self, pname)
+    encode_string(self, pvalue)
+    encode_string(self, ptype)
+  elseif kind == 1 then
+    encode_string(self, (...))
+  else
+    local token, full = ...
+    encode_string(self, token)
+    encode_byte(self, full and 1 or 0)
+  end
+  return confirm_encoding(self)
+end
+
+--- Encodes one measurement of a METRICS_RESP message.
+-- @param #table m The measurement with 'group', 'name' and 'count' fields
+--   and, for durations, 'total', 'max' and 'buckets' fields.
+function Encoder:METRICS_RESP(m)
+  encode_string(self, m.group)
+  encode_string(self, m.name)
+  local values = { m.count }
+  if m.buckets then
+    values[2] = m.total
+    values[3] = m.max
+    for i, count in ipairs(m.buckets) do
+      values[i + 3] = count
+    end
+  end
+  encode_string(self, concat(values, " "))
+  return confirm_encoding(self)
+end
+
 ----------------------
 -- Request messages --
 ----------------------
@@ -284,16 +346,21 @@ function Encoder:RESOLVE_REQ(path, key)
 end
 
 --- Encodes a SUBSCRIBE_REQ message consisting of a path, socket address,
--- subscription type mask and options mask.
+-- subscription type mask, options mask and optional minimum interval.
 -- @param #string path The path to be encoded.
 -- @param #string address The socket address to be encoded.
 -- @param #number subscr_type The subscription type mask to be encoded.
 -- @param #number options The options mask to be encoded.
-function Encoder:SUBSCRIBE_REQ(path, address, subscr_type, options)
+-- @param #number min_interval (optional) The minimum interval in milliseconds
+--                             between two deliveries of events.
+function Encoder:SUBSCRIBE_REQ(path, address, subscr_type, options, min_interval)
   encode_string(self, path)
   encode_string(self, address)
   encode_byte(self, subscr_type)
   encode_byte(self, options)
+  if min_interval then
+    encode_number(self, min_interval)
+  end
   return confirm_encoding(self)
 end
 
@@ -322,6 +389,29 @@ end
 -- @param #string path The path to be encoded.
 Encoder.GPV_NO_ABORT_REQ = Encoder.GPV_REQ
 
+--- Encodes a GPV_DELTA_REQ message consisting of a token or a path.
+-- The token must be encoded first.
+-- @param #string str The token or path to be encoded.
+function Encoder:GPV_DELTA_REQ(str)
+  encode_string(self, str)
+  return confirm_encoding(self)
+end
+
+--- Encodes a GPV_FILTER_REQ message consisting of a filter, parameter
+-- names or a path. The filter and the parameter names must be encoded first.
+-- @param #string str The filter, comma separated parameter names or path to be encoded.
+function Encoder:GPV_FILTER_REQ(str)
+  encode_string(self, str)
+  return confirm_encoding(self)
+end
+
+--- Encodes a METRICS_REQ message consisting of the reset flag.
+-- @param #boolean reset True if the measurements must be cleared.
+function Encoder:METRICS_REQ(reset)
+  encode_byte(self, reset and 1 or 0)
+  return confirm_encoding(self)
+end
+
 ---
 -- Initialize the encoder environment to encode messages of the given tag.
 -- @param #string tag The tag of the message we wish to encode.
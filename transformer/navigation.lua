@@ -26,8 +26,8 @@ See LICENSE file for more details.
 -- it behaves like an object, object type or parameter and the
 -- methods change their behavior based on the information in 'it_state'.
 
-local gsub, match, find = string.gsub, string.match, string.find
-local insert, remove = table.insert, table.remove
+local gsub, match, find, gmatch = string.gsub, string.match, string.find, string.gmatch
+local insert, remove, concat = table.insert, table.remove, table.concat
 local wrap, yield = coroutine.wrap, coroutine.yield
 local tonumber, assert, type, unpack, next, pairs, ipairs =
       tonumber, assert, type, unpack, next, pairs, ipairs
@@ -48,6 +48,9 @@ local logger = require("tch.logger")
 local xpcall = require ("tch.xpcall")
 local traceback = debug.traceback
 
+local metrics = require("transformer.metrics")
+local now, record = metrics.now, metrics.record
+
 -- This table tracks which paths and mappings have been altered (set, add, delete)
 -- and how they were altered.
 -- tracker = {
@@ -103,7 +106,10 @@ local function track(mapping, path, operation)
 end
 
 --- Call the commit function of all mappings that were being tracked.
-local function commit_tracked(store, uuid)
+-- @param committed (optional) Function called once all mappings committed,
+--   before the events are sent.
+-- @return true or the nil + error message returned by `committed`
+local function commit_tracked(store, uuid, committed)
   for mapping,operations in pairs(tracker) do
     if type(mapping.commit) == "function" then
       logger:debug("committing mapping: %s", mapping.objectType.name)
@@ -119,7 +125,12 @@ local function commit_tracked(store, uuid)
     store.eventhor:queueEvents(uuid, mapping, operations)
   end
   tracker = setmetatable({}, mt_outer)
+  local ok, errmsg = true
+  if committed then
+    ok, errmsg = committed()
+  end
   store.eventhor:fireEvents()
+  return ok, errmsg
 end
 
 --- Call the revert function of all mappings that were being tracked.
@@ -166,7 +177,11 @@ local function get_parameter_value(mapping, paramname, key, ...)
   type_get = type(getter)
   if type_get == "function" then
     local rc, errmsg
+    local start = metrics.enabled and now()
     rc, pvalue, errmsg = xpcall(getter, traceback, mapping, paramname, key, ...)
+    if start then
+      record("get", mapping.objectType.name, now() - start)
+    end
     if not rc then  -- getter threw an error, which is returned in 'pvalue'
       logger:error("getter(%s, %s) threw an error: %s", mapping.objectType.name, paramname, pvalue)
       fault.InternalError("get(%s, %s) failed: %s", mapping.objectType.name, paramname, pvalue)
@@ -204,7 +219,10 @@ function Param:get()
   end
 
   if not pvalue then
-    pvalue = get_parameter_value(mapping, paramname, unpack(self.keys))
+    -- the parameters of a filter were already retrieved by matches()
+    local filter_values = self.filter_values
+    pvalue = filter_values and filter_values[paramname]
+      or get_parameter_value(mapping, paramname, unpack(self.keys))
   end
   return self.objpath, paramname, pvalue, param.type
 end
@@ -243,7 +261,11 @@ function Param:set(value)
 
   type_set = type(setter)
   if type_set == "function" then
+    local start = metrics.enabled and now()
     local pcr, svalue, errmsg = xpcall(setter, traceback, mapping, paramname, value, unpack(self.keys))
+    if start then
+      record("set", mapping.objectType.name, now() - start)
+    end
     if not pcr then
       -- setter threw an error
       logger:error("setter threw an error: %s", svalue)
@@ -275,6 +297,13 @@ function Param:isCanDeny()
   return (paraminfo~=nil and paraminfo.activeNotify == "canDeny")
 end
 
+--- Ask whether changes to the parameter are reported through events.
+-- @return True if the mapping of the parameter has event source watches
+--         and the parameter is not canDeny, false otherwise.
+function Param:isEvented()
+  return self.mapping.evented == true and not self:isCanDeny()
+end
+
 -- Metatable to let the iteration state behave like an object.
 local Object = {}
 Object.__index = Object
@@ -331,6 +360,51 @@ function Object:getPath()
   return self.objpath
 end
 
+--- Get the object's path as used in events.
+-- Unlike getPath() this never contains aliases.
+-- @treturn string The datamodel path of this object with instance references.
+function Object:getEventPath()
+  return typePathToObjPath(self.mapping.objectType.name, self.irefs)
+end
+
+--- Check whether the object satisfies a filter.
+-- Only the getters of the parameters named in the filter are called. The
+-- values are kept so Param:get() doesn't retrieve them again.
+-- @param #table filter A filter as returned by compile_filter().
+-- @return True if all clauses of the filter hold, false if one doesn't and
+--         nil if the object doesn't have all the parameters the filter is about.
+function Object:matches(filter)
+  local mapping = self.mapping
+  local parameters = mapping.objectType.parameters
+  self.filter_values = nil
+  for i = 1, #filter do
+    if not parameters[filter[i].name] then
+      return nil
+    end
+  end
+  local values = {}
+  self.filter_values = values
+  for i = 1, #filter do
+    local clause = filter[i]
+    local name = clause.name
+    local value = values[name]
+    if not value then
+      value = get_parameter_value(mapping, name, unpack(self.keys))
+      values[name] = value
+    end
+    if (value == clause.value) ~= clause.equal then
+      return false
+    end
+  end
+  return true
+end
+
+--- Ask whether changes to the object are reported through events.
+-- @return True if the mapping of the object has event source watches.
+function Object:isEvented()
+  return self.mapping.evented == true
+end
+
 local function empty()
 end
 
@@ -345,6 +419,27 @@ local function exact_params_it(it_state)
   return nil
 end
 
+--- Parameter iterator that returns the parameters of the projection
+-- (it_state.projection, an array of names) that the object has.
+local function projected_params_it(it_state)
+  local parameters = it_state.mapping.objectType.parameters
+  local projection = it_state.projection
+  local i = it_state.projection_index
+  local name
+  repeat
+    i = i + 1
+    name = projection[i]
+  until not name or parameters[name]
+  it_state.projection_index = i
+  it_state.paramname = name
+  if name then
+    return it_state
+  end
+  it_state.all_values = nil
+  it_state.projection = nil
+  return nil
+end
+
 --- Parameter iterator that returns all parameters.
 local function all_params_it(it_state)
   it_state.paramname = next(it_state.mapping.objectType.parameters, it_state.paramname)
@@ -357,7 +452,11 @@ end
 
 --- Return an iterator for all the parameters of the object that are
 -- relevant to the request.
-function Object:params()
+-- @param prefetch (optional) If true the values are retrieved with getall()
+--   (when available) even if the action is not "get".
+-- @param projection (optional) An array of parameter names; if given only those
+--   parameters are returned. It doesn't apply to an exact path.
+function Object:params(prefetch, projection)
   setmetatable(self, Param)
   if self.is_exact_path then
     return exact_params_it, self
@@ -365,10 +464,20 @@ function Object:params()
   if self.level == 0 then
     return empty
   end
-  if self.action == "get" then
+  local it = all_params_it
+  if projection then
+    self.projection = projection
+    self.projection_index = 0
+    it = projected_params_it
+  end
+  if self.action == "get" or prefetch then
     local mapping = self.mapping
     if mapping.getall  then
+      local start = metrics.enabled and now()
       local ok, values = xpcall(mapping.getall, traceback, mapping, unpack(self.keys))
+      if start then
+        record("getall", mapping.objectType.name, now() - start)
+      end
       if ok then
         self.all_values = values
       else
@@ -379,7 +488,7 @@ function Object:params()
       self.all_values = nil
     end
   end
-  return all_params_it, self
+  return it, self
 end
 
 -- Metatable to let the iteration state behave like an object type.
@@ -558,6 +667,11 @@ output_instance = function(it_state)
     return
   end
   setmetatable(it_state, Object)
+  -- an object that doesn't match the filter is skipped with its children
+  local filter = it_state.filter
+  if filter and it_state:matches(filter) == false then
+    return
+  end
   yield(it_state)
   if it_state.level == 0 then
     -- return after yielding the instance itself
@@ -709,7 +823,10 @@ end
 --              the results to only that level in the datamodel hierarchy.
 --              For more information on the meaning of this parameter see
 --              ./doc/getparameternames.md
-local function navigate(store, path, action, level)
+-- @param filter (optional) A filter as returned by compile_filter(). Objects
+--              that have the parameters of the filter but don't match it are
+--              not returned and their children aren't visited.
+local function navigate(store, path, action, level, filter)
   -- split path in object and (optionally) param part
   local objpath, paramname = divideInPathParam(path)
   if not objpath then
@@ -745,6 +862,7 @@ local function navigate(store, path, action, level)
     keys = keys,
     objpath = objpath,
     level = level,
+    filter = filter,
     is_exact_path = is_exact_path,
     all_values = nil  -- filled in later in Object:params() when action == "get"
                       -- and the mapping provides a getall() callback
@@ -770,8 +888,138 @@ local function navigate(store, path, action, level)
   return do_action(action, "subtree", it_state, path)
 end
 
+--- Compile the filter expression of a get.
+-- The expression consists of one or more clauses joined by `and`. A clause
+-- compares a parameter with a value, e.g. `Active == "1"` or `Status != Up`;
+-- `==` and `!=` are the only operators.
+-- The value can be quoted with double quotes.
+-- @param #string expr The filter expression.
+-- @return #table An array of clauses, each a table with `name`, `value` and
+--   `equal` (false for `!=`) fields.
+-- or raises an error if the expression is invalid.
+local function compile_filter(expr)
+  local filter = {}
+  for clause in gmatch(gsub(expr, "%s+and%s+", "\0") .. "\0", "(.-)%z") do
+    local name, op, value = match(clause, '^%s*([%w_]+)%s*([=!]=)%s*"(.*)"%s*$')
+    if not name then
+      name, op, value = match(clause, '^%s*([%w_]+)%s*([=!]=)%s*([^%s"]*)%s*$')
+    end
+    if not name then
+      fault.InvalidArguments("invalid filter %s", expr)
+    end
+    filter[#filter + 1] = { name = name, value = value, equal = (op == "==") }
+  end
+  return filter
+end
+
+--- Count state: the parameter count per mapping and the known instances
+-- per multi instance mapping, both filled in on first use.
+local function count_params(state, mapping)
+  local n = state.nparams[mapping]
+  if not n then
+    n = 0
+    for _ in next, mapping.objectType.parameters do
+      n = n + 1
+    end
+    state.nparams[mapping] = n
+  end
+  return n
+end
+
+local count_all
+
+--- Count the parameters of an instance and everything below it.
+-- @param state The count state.
+-- @param mapping The mapping of the instance.
+-- @param #string irefs The instance references string of the instance.
+-- @param #table keys The keys of the instance and its parents, deepest first.
+local function count_instance(state, mapping, irefs, keys)
+  local store = state.store
+  local count = count_params(state, mapping)
+  for childmapping in store:children(mapping) do
+    local objtype = childmapping.objectType
+    if objtype.maxEntries == 1 then
+      if objtype.minEntries == 1 or store:exists(childmapping, keys) then
+        count = count + count_instance(state, childmapping, irefs, keys)
+      end
+    else
+      count = count + count_all(state, childmapping, irefs, keys)
+    end
+  end
+  return count
+end
+
+--- Count the parameters of all known instances of a multi instance
+-- mapping under the given parent.
+count_all = function(state, mapping, parent_irefs, parent_keys)
+  local per_parent = state.instances[mapping]
+  if not per_parent then
+    per_parent = state.store.persistency:getInstancesPerParent(mapping.tp_id)
+    state.instances[mapping] = per_parent
+  end
+  local count = 0
+  local instances = per_parent[parent_irefs]
+  if instances then
+    for _, instance in ipairs(instances) do
+      insert(parent_keys, 1, instance.key)
+      count = count + count_instance(state, mapping, instance.ireferences, parent_keys)
+      remove(parent_keys, 1)
+    end
+  end
+  return count
+end
+
+--- Count the parameters a getlist on the given path would return.
+-- The instances in the path and, for a multi instance path, the instances
+-- of the path itself are synchronized like navigate() does. The multi
+-- instance mappings below it aren't; their instances are counted as known
+-- from earlier synchronizations, so one that was never synchronized counts
+-- as empty. Optional single instances are still checked.
+-- @param store The type store.
+-- @param path The path to count the parameters of.
+-- @return #number The number of parameters.
+local function count(store, path)
+  local objpath, paramname = divideInPathParam(path)
+  if not objpath then
+    fault.InvalidName("invalid path %s", path)
+  end
+  local typepath, irefs, aliases = objectPathToTypepath(objpath)
+  local mappings = store:collectMappings(typepath)
+  irefs = store:convertAliasesToIrefs(mappings, aliases, irefs)
+  local keys
+  keys, irefs = store:getkeys(mappings, irefs, aliases)
+  local mapping = store:get_mapping_incomplete(typepath)
+  if #paramname ~= 0 then
+    if mapping.objectType.name ~= typepath or not mapping.objectType.parameters[paramname] then
+      fault.InvalidName("invalid exact path %s", path)
+    end
+    return 1
+  end
+  local state = { store = store, nparams = {}, instances = {} }
+  local iref_string = concat(irefs, ".")
+  if mapping.objectType.name ~= typepath then
+    -- A multi instance path without instance reference.
+    local count = 0
+    local iks = store:synchronize(mapping, keys, irefs)
+    for _, iref in ipairs(iks) do
+      insert(irefs, 1, iref)
+      insert(keys, 1, iks[iref])
+      count = count + count_instance(state, mapping, concat(irefs, "."), keys)
+      remove(irefs, 1)
+      remove(keys, 1)
+    end
+    return count
+  end
+  if store:isOptionalSingleInstanceMapping(mapping) and not store:exists(mapping, keys) then
+    return 0
+  end
+  return count_instance(state, mapping, iref_string, keys)
+end
+
 local M = {
   navigate = navigate,
+  count = count,
+  compile_filter = compile_filter,
   commit = commit_tracked,
   revert = revert_tracked,
 
@@ -12,8 +12,9 @@ See LICENSE file for more details.
 
 --- Helper module to handle path manipulation.
 -- This module groups all functions related to path processing.
-local match, gsub, sub, find = string.match, string.gsub, string.sub, string.find
-local insert = table.insert
+local match, gsub, sub, find, gmatch = string.match, string.gsub, string.sub, string.find, string.gmatch
+local insert, concat = table.insert, table.concat
+local setmetatable, unpack = setmetatable, unpack
 
 -- The placeholder that indicates transformer needs to operate on it.
 local transformer_placeholder = "{i}"
@@ -101,6 +102,74 @@ function PathFinder.endsWithPassThroughPlaceholder(typepath)
   return (find(typepath, endsWithPassThroughPattern) ~= nil)
 end
 
+--- A bounded cache that evicts the least recently used entry when full.
+-- The entries are kept in a doubly linked list with the most recently
+-- used entry at the head; a hash on the key gives direct access to them.
+local LRU = {}
+LRU.__index = LRU
+
+local function new_lru(size)
+  local head = {}
+  head.prev = head
+  head.next = head
+  return setmetatable({ size = size, count = 0, entries = {}, head = head }, LRU)
+end
+
+local function unlink(entry)
+  entry.prev.next = entry.next
+  entry.next.prev = entry.prev
+end
+
+local function link_first(head, entry)
+  entry.prev = head
+  entry.next = head.next
+  head.next.prev = entry
+  head.next = entry
+end
+
+--- Retrieve the value cached for the given key and mark it as most recently used.
+-- @param key The key to look up.
+-- @return The cached value or nil if it isn't cached.
+function LRU:get(key)
+  local entry = self.entries[key]
+  if entry then
+    unlink(entry)
+    link_first(self.head, entry)
+    return entry.value
+  end
+end
+
+--- Add a value to the cache, evicting the least recently used entry if needed.
+-- @param key The key of the value.
+-- @param value The value to cache.
+function LRU:put(key, value)
+  local entries = self.entries
+  local entry = entries[key]
+  if entry then
+    unlink(entry)
+  else
+    if self.count >= self.size then
+      local oldest = self.head.prev
+      unlink(oldest)
+      entries[oldest.key] = nil
+    else
+      self.count = self.count + 1
+    end
+    entry = { key = key }
+    entries[key] = entry
+  end
+  entry.value = value
+  link_first(self.head, entry)
+end
+
+-- Maximum number of object paths of which the parsed form is cached.
+local path_cache_size = 512
+
+-- Cache of object path -> { typepath, irefs, aliases } as produced by objectPathToTypepath.
+local parsed_cache = new_lru(path_cache_size)
+-- Cache of path -> { objpath, param } as produced by divideInPathParam.
+local divided_cache = new_lru(path_cache_size)
+
 --- Returns the partial path and optional parameter from the given path.
 -- @param #string path The path that needs to be split in partial path and parameter.
 -- @return #string, #string If the given path was a complete path the first argument contains
@@ -109,7 +178,15 @@ end
 --                       this partial path and the second argument is the empty string.
 -- @return #nil, #nil If the given path wasn't a valid path, both return values are nil.
 function PathFinder.divideInPathParam(path)
-  return match(path, "(.*%.)([^%.]*)$")
+  local divided = divided_cache:get(path)
+  if divided then
+    return divided[1], divided[2]
+  end
+  local objpath, param = match(path, "(.*%.)([^%.]*)$")
+  if objpath then
+    divided_cache:put(path, { objpath, param })
+  end
+  return objpath, param
 end
 
 -- Local array of instance references. Used in iref_parse and iref_sub.
@@ -156,40 +233,52 @@ end
 --                         as second argument and the corresponding aliases as third
 --                         argument. The instance references array will also contain the
 --                         aliases if present.
+-- Callers are free to modify the returned arrays so hand out copies of the cached ones.
 function PathFinder.objectPathToTypepath(objectpath)
-  irefs = {}
-  aliases = {}
-  -- Parse out the instance references from the path.
-  local typepath = gsub(objectpath, "([^%.]+)", iref_parse)
-  return typepath, irefs, aliases
+  local parsed = parsed_cache:get(objectpath)
+  if not parsed then
+    irefs = {}
+    aliases = {}
+    -- Parse out the instance references from the path.
+    local typepath = gsub(objectpath, "([^%.]+)", iref_parse)
+    parsed = { typepath, irefs, aliases }
+    parsed_cache:put(objectpath, parsed)
+  end
+  return parsed[1], { unpack(parsed[2]) }, { unpack(parsed[3]) }
 end
 
-local count
+-- Cache of typepath -> compiled object path template.
+-- The number of typepaths is bounded by the loaded mappings so this
+-- cache doesn't need an eviction policy.
+local templates = {}
 
---- Method used to parse type path fragments.
--- If the fragment indicates it's a pass-through or a transformer placeholder,
--- it will be replaced by the corresponding instance reference or alias.
--- @param #string part The fragment we need to inspect.
--- @return #string An instance reference or alias if the fragment requires it, otherwise the
---                 fragment itself is returned.
-local function iref_sub(part)
-  --if PathFinder.isMultiInstance(part) then
-  if (part == transformer_placeholder) or (part == passthrough_placeholder) then
-    if aliases[count] and aliases[count] ~= no_alias then
-      local alias = aliases[count]
-      alias = transformer_alias_placeholder .. alias .. "]"
-      count = count - 1
-      return alias
-    else
-      local iref = irefs[count]
-      if part == passthrough_placeholder then
-        iref = passthrough_placeholder..iref
-      end
-      count = count - 1
-      return iref
+--- Compile a type path into a template to build object paths with.
+-- The template is an array with the literal parts of the type path and
+-- a slot (initially false) for every placeholder. `slots` lists the
+-- positions of the slots from left to right and `passthrough` tells for
+-- each slot if it stands for a pass-through placeholder.
+-- @param #string typepath The type path to compile.
+-- @return #table The compiled template.
+local function compile_typepath(typepath)
+  local template = templates[typepath]
+  if template then
+    return template
+  end
+  local parts, slots, passthrough = {}, {}, {}
+  local literal_start = 1
+  for first, part, last in gmatch(typepath, "()([^%.]+)()") do
+    if (part == transformer_placeholder) or (part == passthrough_placeholder) then
+      parts[#parts + 1] = sub(typepath, literal_start, first - 1)
+      parts[#parts + 1] = false
+      slots[#slots + 1] = #parts
+      passthrough[#slots] = (part == passthrough_placeholder)
+      literal_start = last
     end
   end
-  return part
+  parts[#parts + 1] = sub(typepath, literal_start)
+  template = { parts = parts, slots = slots, passthrough = passthrough }
+  templates[typepath] = template
+  return template
 end
 
 --- Replace placeholders with real instance references or aliases,
@@ -201,12 +290,34 @@ end
 -- Note: the length of the irefs array must equal the number of placeholders
 --   in typepath.
 function PathFinder.typePathToObjPath(typepath, ireferences, alias)
-  irefs = ireferences
-  aliases = alias or {}
-  count = #irefs
-  return gsub(typepath, "([^%.]+)", iref_sub)
+  local template = compile_typepath(typepath)
+  local slots = template.slots
+  if #slots == 0 then
+    return typepath
+  end
+  local parts, passthrough = template.parts, template.passthrough
+  -- The references are in reverse order so the first slot takes the last one.
+  local count = #ireferences
+  for i = 1, #slots do
+    local value = alias and alias[count]
+    if value and value ~= no_alias then
+      value = transformer_alias_placeholder .. value .. "]"
+    else
+      value = ireferences[count]
+      if passthrough[i] then
+        value = passthrough_placeholder .. (value or "")
+      elseif not value then
+        value = transformer_placeholder
+      end
+    end
+    parts[slots[i]] = value
+    count = count - 1
+  end
+  return concat(parts)
 end
 
+PathFinder.compileTypePath = compile_typepath
+
 PathFinder.transformer_placeholder = transformer_placeholder
 PathFinder.passthrough_placeholder = passthrough_placeholder
 PathFinder.stripEndNoTrailingDot = stripEndNoTrailingDot
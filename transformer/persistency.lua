@@ -27,7 +27,7 @@ local M = {}
 
 local require, tostring, pairs, ipairs, setmetatable, type, next =
       require, tostring, pairs, ipairs, setmetatable, type, next
-local format = string.format
+local format, find, sub, match = string.format, string.find, string.sub, string.match
 local concat, sort = table.concat, table.sort
 
 local db = require("transformer.persistency.db")
@@ -197,6 +197,29 @@ local function addInstance(db, cpath, iref_parent, tp_id, key, parent_db_id, key
   fault.InternalError("Persistency: no instance to add!");
 end
 
+--- Drop the mirrored instances below the given deleted objects.
+-- The database deletes the children of an object in cascade so all
+-- mirror entries whose parent is (a descendant of) a deleted object are
+-- stale. The ireferences of such a parent end with the ireferences of
+-- the deleted object.
+-- @param #table mirror The instance mirror.
+-- @param #table deleted A set with the ireferences strings of the deleted objects.
+local function invalidate_below(mirror, deleted)
+  for _, entries in pairs(mirror) do
+    for parent_iref in pairs(entries) do
+      local stale = deleted[parent_iref]
+      local pos = find(parent_iref, ".", 1, true)
+      while not stale and pos do
+        stale = deleted[sub(parent_iref, pos + 1)]
+        pos = find(parent_iref, ".", pos + 1, true)
+      end
+      if stale then
+        entries[parent_iref] = nil
+      end
+    end
+  end
+end
+
 --- Get the key of the given typepath ID and instance references.
 -- @param #number tp_id The database ID of the full typepath of the object.
 -- @param #table ireferences The table with all instance references.
@@ -251,6 +274,29 @@ function Persistency:getKnownAliases(tp_id, ireferences_parent)
   return known_aliases
 end
 
+--- Retrieve all known instances of the given typepath ID grouped per parent.
+-- Only instances that were synchronized before are known; nothing is
+-- synchronized here.
+-- @param #number tp_id The database ID of the typepath.
+-- @return #table The instances keyed on the instance references string of
+--   their parent. Each entry is an array of tables with an `ireferences`
+--   field (the instance references string of the instance) and a `key` field.
+function Persistency:getInstancesPerParent(tp_id)
+  local per_parent = {}
+  for _, row in ipairs(self._db:getInstances(tp_id)) do
+    -- The ireferences are in reverse order so the parent part is everything
+    -- after the first instance reference.
+    local parent = match(row.ireferences, "^[^.]*%.(.*)$") or ""
+    local list = per_parent[parent]
+    if not list then
+      list = {}
+      per_parent[parent] = list
+    end
+    list[#list + 1] = row
+  end
+  return per_parent
+end
+
 --- Add an entry to the database.
 -- @param #number tp_id The database ID of the typepath of the object to add.
 -- @param #table ireferences_parent The instance references of the parent object.
@@ -265,6 +311,8 @@ function Persistency:addKey(tp_id, ireferences_parent, key)
   -- Check if the given key is a string or a table.
   local keysTuples = (type(key) == "table")
 
+  -- The mirrored instances of this type no longer match the database.
+  self._mirror[tp_id] = nil
   return addInstance(db, cpath, iref, tp_id, key, parent.id, keysTuples)
 end
 
@@ -275,6 +323,9 @@ end
 function Persistency:delKey(tp_id, ireferences)
   local iref = string_from_ireferences(ireferences)
   self._db:deleteObject(tp_id, iref)
+  self._mirror[tp_id] = nil
+  invalidate_below(self._mirror, { [iref] = true })
+  self._generation = self._generation + 1
 end
 
 local function query_keys_impl(db, tp_id, level)
@@ -392,26 +443,84 @@ local function iref_sort(iref1, iref2)
   return (diff < 0)
 end
 
+--- Build the signature of a list of keys.
+-- Two key lists with the same signature contain the same keys in the same order.
+-- @param #table keys The list of keys as returned by an entries function.
+-- @param #boolean keysTuples Indicates if the keys are {instance, key} tuples.
+-- @return #string The signature of the key list or nil if the keys are invalid;
+--                 syncing will report the error in that case.
+local function keys_signature(keys, keysTuples)
+  if not keysTuples then
+    local ok, signature = pcall(concat, keys, "\0")
+    return ok and signature or nil
+  end
+  local parts = {}
+  for i, key in ipairs(keys) do
+    parts[i] = tostring(key[1]) .. "\1" .. tostring(key[2])
+  end
+  return concat(parts, "\0")
+end
+
+--- Build the list of objects present in the database from a mirror entry.
+-- The result has the same layout as the result of db:getChildren() but
+-- each object also carries its instance reference at this level.
+local function objects_from_mirror(tp_id, iref, keymap)
+  local objects = {}
+  for i, instance in ipairs(keymap) do
+    local key = keymap[instance]
+    objects[i] = {
+      tp_id = tp_id,
+      ireferences = string_append_instance(iref, instance),
+      key = key,
+      instance = instance,
+    }
+    objects[key] = i
+  end
+  return objects
+end
+
 -- the actual implementation of the sync
-local function sync_impl(db, tp_id, keys, ireferences_parent)
+local function sync_impl(self, tp_id, keys, ireferences_parent)
+  local db = self._db
   local keymap = {}
   local new_entries = {}
   local iref = string_from_ireferences(ireferences_parent)
 
-  local parent, child = getParentOfMulti(db, tp_id, iref)
-  assert(parent, "a parent does not exist")
-
-  -- retrieve the objects currently in the database
-  local db_objects = db:getChildren(parent.id, tp_id)
-
   -- Check if the given keys are strings or tables.
   local keysTuples = false
   if keys and type(keys[1]) == "table" then
     keysTuples = true
   end
 
+  -- If the keys didn't change since the previous sync the database
+  -- still holds exactly the instances we mirrored at that time.
+  local signature = keys_signature(keys, keysTuples)
+  local mirror = self._mirror[tp_id]
+  if not mirror then
+    mirror = {}
+    self._mirror[tp_id] = mirror
+  end
+  local mirrored = mirror[iref]
+  if mirrored and signature and mirrored.signature == signature then
+    return mirrored.keymap, new_entries
+  end
+
+  local parent, child = getParentOfMulti(db, tp_id, iref)
+  assert(parent, "a parent does not exist")
+
+  -- retrieve the objects currently in the database
+  local db_objects
+  if mirrored then
+    db_objects = objects_from_mirror(tp_id, iref, mirrored.keymap)
+  else
+    db_objects = db:getChildren(parent.id, tp_id)
+  end
+
   -- build the result keymap by making sure all the given keys are in
   -- the database.
+  local new_objects = {}
+  local endsWithTransformed = (not endsWithPassThroughPlaceholder(child))
+  local counter -- last instance number handed out, if any
   for _, key in ipairs(keys) do
     local actual_key = key
     if keysTuples then
@@ -428,30 +537,84 @@ local function sync_impl(db, tp_id, keys, ireferences_parent)
       db_objects[actual_key] = nil
 
       -- extract the instance reference at this level
-      local inst = ireferences_from_string(obj.ireferences)
-      instance = inst[1]
+      instance = obj.instance
+      if not instance then
+        local inst = ireferences_from_string(obj.ireferences)
+        instance = inst[1]
+      end
     else
-      -- addInstance will either succeed or throw an error.
-      instance = addInstance(db, child, iref, tp_id, key, parent.id, keysTuples)
+      -- Generate the instance reference like addInstance does but
+      -- postpone the insert so all new objects are added in bulk.
+      if endsWithTransformed then
+        counter = (counter or db:getCount(parent.id, tp_id)) + 1
+        instance = tostring(counter)
+      elseif keysTuples then
+        instance = key[1]
+      else
+        instance = key
+      end
+      if type(actual_key)~='string' then
+        local err_msg = "key is not a string but "..type(actual_key)
+        logger:error(err_msg)
+        fault.InternalError(err_msg)
+      end
+      if not instance then
+        fault.InternalError("Persistency: no instance to add!")
+      end
+      new_objects[#new_objects + 1] = {
+        tp_id = tp_id,
+        ireferences = string_append_instance(iref, tostring(instance)),
+        key = actual_key,
+        parent = parent.id,
+      }
       new_entries[instance] = actual_key
     end
-    if instance then
-      keymap[#keymap + 1] = instance
-      keymap[instance] = actual_key
+    keymap[#keymap + 1] = instance
+    keymap[instance] = actual_key
+  end
+
+  if #new_objects > 0 then
+    local ok, _, failed = db:insertObjects(new_objects)
+    if not ok then
+      -- Redo the failed inserts one by one to report the offending object.
+      for i = failed, #new_objects do
+        local obj = new_objects[i]
+        local inserted, msg = db:insertObject(obj.tp_id, obj.ireferences, obj.key, obj.parent)
+        if inserted==nil then
+          local err_msg = format("database: %s, tp_id='%d', ireferences='%s', key='%s'", msg, tp_id, obj.ireferences, obj.key)
+          logger:error(err_msg)
+          fault.InternalError(err_msg)
+        end
+      end
+    end
+    if counter then
+      db:setCount(parent.id, tp_id, counter)
     end
   end
 
   -- whatever objects remain in the database list, do no longer exist
   -- in reality.
   -- remove them from the database.
+  local deleted, deleted_list, deleted_irefs
   for _, obj in pairs(db_objects) do
     if type(obj)=='table' then
-      db:deleteObject(obj.tp_id, obj.ireferences)
+      deleted = deleted or {}
+      deleted_list = deleted_list or {}
+      deleted_irefs = deleted_irefs or {}
+      deleted[obj.ireferences] = true
+      deleted_list[#deleted_list + 1] = obj.ireferences
+      deleted_irefs[#deleted_irefs + 1] = ireferences_from_string(obj.ireferences)
     end
   end
+  if deleted then
+    db:deleteObjects(tp_id, deleted_list)
+    invalidate_below(self._mirror, deleted)
+    self._generation = self._generation + 1
+  end
 
   sort(keymap, iref_sort)
-  return keymap, new_entries
+  mirror[iref] = { signature = signature, keymap = keymap }
+  return keymap, new_entries, deleted_irefs
 end
 
 --- Synchronize the database for the given typepath ID.
@@ -466,19 +629,23 @@ end
 --                        can't just use pairs() to iterate it; you should use ipairs().
 --                        The second return value is a mapping of all NEW instance
 --                        references on this level to their keys.
+--                        The optional third return value is an array with the
+--                        instance references of the instances that no longer exist.
+--                        The returned keymap is shared with the instance mirror
+--                        and must not be modified.
 -- The database is updated to match this state.
 -- In case of a constraint violation the function returns nil and the database
 -- is not changed.
 function Persistency:sync(tp_id, keys, ireferences_parent)
   local db = self._db
-  local keymap, new_keys
+  local keymap, new_keys, deleted
 
   -- wrap the sync_impl call in a transaction to handle the error case.
   -- We don't know if this is the outer transaction, so create an inner one
   -- to be safe.
   local savepoint = db:startTransaction(false)
   local ok
-  ok, keymap, new_keys = pcall(sync_impl, db, tp_id, keys, ireferences_parent)
+  ok, keymap, new_keys, deleted = pcall(sync_impl, self, tp_id, keys, ireferences_parent)
   local commit = ok and keymap
   if commit then
     db:commitTransaction(savepoint)
@@ -489,7 +656,7 @@ function Persistency:sync(tp_id, keys, ireferences_parent)
     -- propagate error
     error(keymap)
   end
-  return keymap, new_keys
+  return keymap, new_keys, deleted
 end
 
 --- Split the given typepath in typepath chunks.
@@ -524,9 +691,17 @@ function Persistency:addTypePath(typepath)
   return self._db:insertTypePath(create_tp_chunks(typepath))
 end
 
+--- Get the highest typepath ID in the database.
+-- It only changes when a new typepath is added.
+-- @return #number The highest typepath ID.
+function Persistency:lastTypePathID()
+  return self._db:lastTypePathID()
+end
+
 function Persistency:close()
   self._db:close()
   self._db = nil
+  self._mirror = nil
 end
 
 --- Start a transaction on database level.
@@ -551,12 +726,38 @@ end
 --       will also be reverted.
 function Persistency:revertTransaction()
   self._db:rollbackTransaction()
+  -- The mirror may contain instances that were just rolled back.
+  self._mirror = {}
+  self._generation = self._generation + 1
+end
+
+--- Get the generation of the database content.
+-- The generation changes whenever instances are removed from the database
+-- (or the instances added or removed in a transaction are rolled back), so
+-- information derived from existing instances stays valid as long as the
+-- generation doesn't change.
+-- @return #number The current generation.
+function Persistency:generation()
+  return self._generation
+end
+
+--- Save the database to its persistent location.
+-- Only needed when the database runs on a working copy; see db:checkpoint().
+-- NOTE: This must not be called while a transaction is in progress.
+function Persistency:checkpoint()
+  return self._db:checkpoint()
 end
 
 Persistency.__index = Persistency
-function M.new(dbpath, dbname)
+function M.new(dbpath, dbname, profile, workdir)
   local p={
-    _db = db.new(dbpath, dbname);
+    _db = db.new(dbpath, dbname, profile, workdir);
+    -- Write-through mirror of the synchronized instances:
+    -- _mirror[tp_id][parent ireferences] = { signature = ..., keymap = ... }
+    -- where signature identifies the key list the keymap was synced with.
+    _mirror = {};
+    -- see Persistency:generation()
+    _generation = 0;
   }
 
   return setmetatable(p, Persistency)
@@ -56,7 +56,9 @@ The combination (tp_id, ireferences) must be unique, the combination
 
 Access functions for the Objects table:
   * insertObject
+  * insertObjects
   * deleteObject
+  * deleteObjects
   * getObject
   * getObjectByKey
   * getObjectByAlias
@@ -107,6 +109,7 @@ local concat = table.concat
 local pairs = pairs
 local ipairs = ipairs
 local format = string.format
+local match, gsub = string.match, string.gsub
 local pcall = pcall
 local setmetatable = setmetatable
 local type = type
@@ -119,6 +122,9 @@ local M = {
 
 local logger = require("tch.logger")
 local sqlite = require("lsqlite3")
+local fsync = require("lfsync").fsync
+local metrics = require("transformer.metrics")
+local now, record = metrics.now, metrics.record
 
 --- Return the full database path.
 -- @param dbpath The directory where the database should reside. Nil is not allowed.
@@ -192,7 +198,7 @@ end
 -- @return #boolean, #table The boolean will be true if the statement ran without error
 --    and false if some error occurred. The table will contain the result if no error occurred
 --    or an database error table otherwise.
-local function query(db, sql, run_once, vars, results_param)
+local function run_query(db, sql, run_once, vars, results_param)
   local dbh = db._handle
   local db_err
 
@@ -267,6 +273,35 @@ local function query(db, sql, run_once, vars, results_param)
   return ok, results
 end
 
+-- the names under which the durations of the SQL statements are recorded
+local metric_names = {}
+
+local function metric_name(sql, run_once)
+  local name = metric_names[sql]
+  if not name then
+    if run_once then
+      -- Statements that run only once can embed unique names (e.g. the name
+      -- of a savepoint) so only their verb is used to keep the set bounded.
+      return match(sql, "^%s*(%a+)") or sql
+    end
+    name = gsub(match(sql, "^%s*(.-)%s*$"), "%s+", " ")
+    metric_names[sql] = name
+  end
+  return name
+end
+
+--- Run a SQL statement and record its duration if the metrics are enabled.
+-- The parameters and return values are those of run_query().
+local function query(db, sql, run_once, vars, results_param)
+  if not metrics.enabled then
+    return run_query(db, sql, run_once, vars, results_param)
+  end
+  local start = now()
+  local ok, results = run_query(db, sql, run_once, vars, results_param)
+  record("sql", metric_name(sql, run_once), now() - start)
+  return ok, results
+end
+
 --- Utility wrapper to execute an SQL statement once.
 -- @param db The database to run the SQL statement against.
 -- @param sql The SQL statement to execute.
@@ -287,9 +322,183 @@ local function close(db)
 end
 
 
-local function dbfile_open(db, dbpath, dbname)
+--- The tuning profiles for the database.
+-- Each profile lists the PRAGMAs (and their values) to apply when the
+-- database is opened. They are applied in the order of `profile_pragmas`.
+local profiles = {
+  -- Use WAL journal mode; measurements have shown this to be faster.
+  default = {
+    journal_mode = "WAL",
+    wal_autocheckpoint = 128,
+  },
+  -- Trade durability of the last transactions on power loss for far less
+  -- fsyncs: in WAL mode with synchronous=NORMAL the database stays consistent
+  -- but only checkpoints sync to flash. The remaining settings keep more
+  -- of the database in memory: a 4 MiB page cache (twice SQLite's default),
+  -- memory mapped reads and temporary tables in memory.
+  performance = {
+    journal_mode = "WAL",
+    wal_autocheckpoint = 1000,
+    synchronous = "NORMAL",
+    mmap_size = 2097152,
+    cache_size = -4096,
+    temp_store = "MEMORY",
+  },
+}
+M.profiles = profiles
+
+local profile_pragmas = {
+  "journal_mode",
+  "wal_autocheckpoint",
+  "synchronous",
+  "mmap_size",
+  "cache_size",
+  "temp_store",
+}
+
+local known_pragmas = {}
+for _, pragma in ipairs(profile_pragmas) do
+  known_pragmas[pragma] = true
+end
+
+--- Apply a tuning profile to an opened database.
+-- @param db The database object.
+-- @param profile The name of one of the predefined profiles or a table
+--    with PRAGMA values. A table can name a predefined profile in its
+--    `base` field; its other values override the ones of that profile.
+--    If nil the default profile is used. Unknown PRAGMAs and PRAGMAs set
+--    to false (no value given) are logged and ignored.
+local function apply_profile(db, profile)
+  local name, overrides = profile, {}
+  if type(profile) == "table" then
+    name, overrides = profile.base, profile
+  end
+  name = name or "default"
+  local base = profiles[name]
+  if not base then
+    error(format("unknown database profile '%s'", tostring(name)))
+  end
+  for pragma in pairs(overrides) do
+    if pragma ~= "base" and not known_pragmas[pragma] then
+      logger:warning("ignoring unknown database pragma '%s'", tostring(pragma))
+    end
+  end
+  for _, pragma in ipairs(profile_pragmas) do
+    local value = overrides[pragma]
+    if value == false then
+      logger:warning("ignoring database pragma '%s' without a value", pragma)
+      value = nil
+    end
+    if value == nil then
+      value = base[pragma]
+    end
+    if value ~= nil then
+      value = tostring(value)
+      if not value:match("^%-?[%w]+$") then
+        error(format("invalid value '%s' for %s", value, pragma))
+      end
+      execSql(db, format("PRAGMA %s=%s;", pragma, value))
+    end
+  end
+end
+
+--- Check if a file exists.
+local function file_exists(path)
+  local f = io.open(path, "rb")
+  if f then
+    f:close()
+    return true
+  end
+  return false
+end
+
+--- Retrieve the directory a file is in.
+local function dirname(path)
+  return match(path, "^(.*)/[^/]*$") or "."
+end
+
+--- Copy a file atomically: the copy is written next to the destination
+-- and renamed over it when complete, so a crash never leaves a partial file.
+-- The copy is synced to storage before the rename and the directory after
+-- it, so a power loss can't persist the rename without the data.
+-- @param from The path of the file to copy.
+-- @param to The path of the copy.
+-- @return true or nil + error message
+local function copy_file_atomic(from, to)
+  local tmp = to..".tmp"
+  local src, errmsg = io.open(from, "rb")
+  if not src then
+    return nil, errmsg
+  end
+  local dst
+  dst, errmsg = io.open(tmp, "wb")
+  if not dst then
+    src:close()
+    return nil, errmsg
+  end
+  local ok = true
+  while ok do
+    local data = src:read(65536)
+    if not data then
+      break
+    end
+    ok, errmsg = dst:write(data)
+  end
+  src:close()
+  if ok then
+    ok, errmsg = dst:flush()
+  end
+  dst:close()
+  if ok then
+    ok, errmsg = fsync(tmp)
+  end
+  if ok then
+    ok, errmsg = os.rename(tmp, to)
+  end
+  if not ok then
+    os.remove(tmp)
+    return nil, errmsg
+  end
+  return fsync(dirname(to))
+end
+
+--- Prepare the working copy of the database.
+-- After a reboot the working directory (typically on tmpfs) is empty and
+-- the working copy is restored from the last checkpoint. If Transformer
+-- was merely restarted the existing working copy is more recent and is
+-- used as is.
+-- @param persistent The full path of the persistent database.
+-- @param working The full path of the working copy.
+local function prepare_working_copy(persistent, working)
+  -- leftover of an interrupted checkpoint; the persistent file is still intact
+  os.remove(persistent..".tmp")
+  if file_exists(working) or not file_exists(persistent) then
+    return
+  end
+  if file_exists(persistent.."-wal") then
+    -- The database was used directly before; opening and closing it
+    -- merges the WAL file in the database.
+    local h = sqlite.open(persistent)
+    if h then
+      h:close()
+    end
+  end
+  local ok, errmsg = copy_file_atomic(persistent, working)
+  if not ok then
+    logger:error("failed to restore %s from %s: %s", working, persistent, tostring(errmsg))
+  end
+end
+
+local function dbfile_open(db, dbpath, dbname, profile, workdir)
   local convert = require 'transformer.persistency.convert'
 
+  if dbpath~=nil and workdir~=nil then
+    -- Run on a working copy and only checkpoint it to dbpath now and then.
+    db._persistent = get_fulldbpath(dbpath, dbname)
+    dbpath = workdir
+    prepare_working_copy(db._persistent, get_fulldbpath(dbpath, dbname))
+  end
+
   repeat
     local db_ok
     local filepath
@@ -311,13 +520,11 @@ local function dbfile_open(db, dbpath, dbname)
     -- Turn the enforcement of foreign keys on in SQLite.
     -- This is needed for the foreign key clause. (REFERENCES...)
     execSql(db, "PRAGMA foreign_keys=1;")
-    -- Use WAL journal mode; measurements have shown this to be faster.
     -- Set locking mode to exclusive so no shared memory wal-index is created;
     -- apparently it doesn't work on target and we don't need it anyhow because
     -- Transformer is the only process accessing the database.
     execSql(db, "PRAGMA locking_mode=EXCLUSIVE;")
-    execSql(db, "PRAGMA journal_mode=WAL;")
-    execSql(db, "PRAGMA wal_autocheckpoint=128;")
+    apply_profile(db, profile)
 
 
     local temp_db = {
@@ -341,6 +548,9 @@ local function dbfile_open(db, dbpath, dbname)
       end
     end
   until db_ok
+  if db._persistent then
+    db._working = get_fulldbpath(dbpath, dbname)
+  end
 
   -- make sure the convert module can be garbage collected
   package.loaded['transformer.persistency.convert'] = nil
@@ -353,9 +563,12 @@ end
 -- @param db The table in which to create the internal object.
 -- @param dbpath The path of the database name. If nil open a memory database.
 -- @param dbname The name of the database file. If nil use transformer.db
+-- @param profile The tuning profile to apply (see `apply_profile`).
+-- @param workdir If given, the database is opened in this directory and only
+--    copied to dbpath when checkpointed (see db:checkpoint()).
 -- NOTE: This function raises an error if opening the database fails for some reason.
-local function open(db, dbpath, dbname)
-  dbfile_open(db, dbpath, dbname)
+local function open(db, dbpath, dbname, profile, workdir)
+  dbfile_open(db, dbpath, dbname, profile, workdir)
 
 
   -- Create typepaths table
@@ -498,6 +711,34 @@ function db:commitTransaction(savepoint)
   check(query(self, sqlStatement, true))
 end
 
+--- Copy the working copy of the database to its persistent location.
+-- This only does something if the database was opened with a working
+-- directory and it changed since the previous checkpoint.
+-- NOTE: This must not be called while a transaction is in progress.
+-- @return #boolean True if the persistent database is up to date, false if the
+--    database has no working copy. An error is raised if the copy failed.
+function db:checkpoint()
+  local persistent = self._persistent
+  if not persistent then
+    return false
+  end
+  local changes = self._handle:total_changes()
+  if changes == self._checkpointed then
+    return true
+  end
+  -- make sure everything is in the database file itself
+  execSql(self, "PRAGMA wal_checkpoint(TRUNCATE);")
+  local ok, errmsg = copy_file_atomic(self._working, persistent)
+  if not ok then
+    error(format("checkpoint to %s failed: %s", persistent, tostring(errmsg)))
+  end
+  -- a WAL file of the persistent database would be applied on top of the
+  -- checkpoint when restoring it
+  os.remove(persistent.."-wal")
+  self._checkpointed = changes
+  return true
+end
+
 --- Retrieve the typepath chunk ID of a given typepath chunk and parent ID.
 -- @param #table db The database table itself.
 -- @param #string tp_chunk The typepath chunk we are interested in.
@@ -586,6 +827,12 @@ function db:insertTypePath(tp_chunks)
   return chunk_id
 end
 
+--- Get the highest typepath chunk ID in the database.
+-- @return #number The highest ID or 0 if there are no typepaths.
+function db:lastTypePathID()
+  return self._last_tpid
+end
+
 --- Fetch the row in the 'typepaths' table with the given typepath ID.
 -- @param #number tp_id The database ID of a type path in the tree.
 -- @return #table A table representation of the typepath chunk or nil if not found.
@@ -828,6 +1075,29 @@ function db:getSiblings(tp_id)
   return siblings
 end
 
+--- Get the instance references and keys of all instances of the given typepath ID.
+-- @param #number tp_id The database ID of the typepath for which to retrieve all instances.
+-- @return #table A list of objects with the given typepath ID.
+-- The table representation has the following layout:
+-- {
+--   ireferences=...
+--   key=...
+-- }
+-- The values are the corresponding values retrieved from the DB.
+function db:getInstances(tp_id)
+  return check(query(
+    self,
+    [[
+      SELECT ireferences, key
+      FROM objects
+      WHERE tp_id=:tp_id
+    ]],
+    false,
+    {tp_id=tp_id},
+    {}
+  ))
+end
+
 --- Get all possible parent objects for a given typepath ID.
 -- @param #number tp_id The database ID of the typepath for which to retrieve all possible parent objects.
 -- @return #table A list of objects with the given typepath ID as parent.
@@ -923,6 +1193,111 @@ function db:deleteObject(tp_id, ireferences)
   ))
 end
 
+-- Maximum number of rows handled by a single bulk statement.
+-- SQLite limits the number of variables in a statement to 999 by default.
+local BULK_ROWS = 32
+
+-- Cache of the SQL text of the bulk statements, keyed on the number of rows.
+local bulk_insert_sql = {}
+local bulk_delete_sql = {}
+
+local function get_bulk_insert_sql(rows)
+  local sql = bulk_insert_sql[rows]
+  if not sql then
+    local values = {}
+    for i = 1, rows do
+      values[i] = format("(:id%d, :tp_id%d, :ireferences%d, :key%d, :parent%d)", i, i, i, i, i)
+    end
+    sql = "INSERT INTO objects(id, tp_id, ireferences, key, parent) VALUES " .. concat(values, ", ")
+    bulk_insert_sql[rows] = sql
+  end
+  return sql
+end
+
+local function get_bulk_delete_sql(rows)
+  local sql = bulk_delete_sql[rows]
+  if not sql then
+    local values = {}
+    for i = 1, rows do
+      values[i] = format(":ireferences%d", i)
+    end
+    sql = "DELETE FROM objects WHERE tp_id=:tp_id AND ireferences IN (" .. concat(values, ", ") .. ")"
+    bulk_delete_sql[rows] = sql
+  end
+  return sql
+end
+
+--- Insert several new objects in the 'objects' table.
+-- The objects are inserted with multi-row INSERT statements so a big
+-- batch of new objects costs only a few statements.
+-- @param #table objects An array of objects to insert, each one a table with
+--    the tp_id, ireferences, key and parent fields (see insertObject).
+--    On success their id field is filled in.
+-- @return #boolean True if all objects were inserted or nil, an error
+-- message and the index of the first object of the failing statement in case
+-- there was a constraint violation. The objects from that index on are not
+-- inserted.
+function db:insertObjects(objects)
+  local total = #objects
+  local first = 1
+  while first <= total do
+    local rows = total - first + 1
+    if rows > BULK_ROWS then
+      rows = BULK_ROWS
+    end
+    local vars = {}
+    local nextID = self._lastid
+    for i = 1, rows do
+      local obj = objects[first + i - 1]
+      local keyType = type(obj.key)
+      if keyType~='string' then
+        return nil, 'key is not a string but '..keyType, first
+      end
+      nextID = nextID + 1
+      obj.id = nextID
+      vars["id"..i] = nextID
+      vars["tp_id"..i] = obj.tp_id
+      vars["ireferences"..i] = obj.ireferences
+      vars["key"..i] = obj.key
+      vars["parent"..i] = obj.parent
+    end
+    local ok, e = query(self, get_bulk_insert_sql(rows), false, vars)
+    if not ok then
+      if e.err==sqlite.CONSTRAINT then
+        return nil, e.msg, first
+      else
+        check(false, e)
+      end
+    end
+    self._lastid = nextID
+    first = first + rows
+  end
+  return true
+end
+
+--- Remove several rows of the same typepath from the 'objects' table.
+-- @param #number tp_id The database ID of the typepath of the objects.
+-- @param #table ireferences_list An array with the instance reference strings
+--    of the objects to delete.
+-- @return nil
+-- Just like deleteObject this deletes the children of the objects too.
+function db:deleteObjects(tp_id, ireferences_list)
+  local total = #ireferences_list
+  local first = 1
+  while first <= total do
+    local rows = total - first + 1
+    if rows > BULK_ROWS then
+      rows = BULK_ROWS
+    end
+    local vars = { tp_id = tp_id }
+    for i = 1, rows do
+      vars["ireferences"..i] = ireferences_list[first + i - 1]
+    end
+    check(query(self, get_bulk_delete_sql(rows), false, vars))
+    first = first + rows
+  end
+end
+
 --- Get the value of a counter from the 'counters' table.
 -- @param #number parentid The id of the parent object in the 'objects' table.
 -- @param #number tp_id The database ID of the typepath chunk of the child portion of the type path.
@@ -969,9 +1344,9 @@ function db:setCount(parentid, tp_id, value)
 end
 
 db.__index = db
-function M.new(dbpath, dbname)
+function M.new(dbpath, dbname, profile, workdir)
   local result_db = {}
-  local ok, err = pcall(open, result_db, dbpath, dbname)
+  local ok, err = pcall(open, result_db, dbpath, dbname, profile, workdir)
   if ok then
     setmetatable(result_db, db)
     return result_db
@@ -11,9 +11,14 @@ Clear BSD License (http://directory.fsf.org/wiki/License:ClearBSD)
 See LICENSE file for more details.
 ]]
 
-local require, ipairs, unpack, tonumber, pcall = require, ipairs, unpack, tonumber, pcall
+local require, ipairs, pairs, unpack, tonumber, pcall = require, ipairs, pairs, unpack, tonumber, pcall
+local floor = math.floor
 
 local transformer  -- our instance of Transformer
+local metrics = require("transformer.metrics")
+local tracer = require("transformer.tracer")
+local checkpoint_config  -- when to checkpoint the database (if it runs on a working copy)
+local ubus_cache_ttl  -- how long ubus call results are reused after a read request
 
 local uloop = require("uloop")
 uloop.init()
@@ -53,6 +58,66 @@ do
       if uci_config.dbname then
         config.persistency_name = uci_config.dbname
       end
+      if uci_config.dbworkdir then
+        config.persistency_workdir = uci_config.dbworkdir
+      end
+      if uci_config.dbcheckpoint_idle then
+        config.checkpoint_idle = tonumber(uci_config.dbcheckpoint_idle) or config.checkpoint_idle
+      end
+      if uci_config.dbcheckpoint_interval then
+        config.checkpoint_interval = tonumber(uci_config.dbcheckpoint_interval) or config.checkpoint_interval
+      end
+      if uci_config.dbprofile then
+        config.persistency_profile = uci_config.dbprofile
+      end
+      if uci_config.dbpragmas then
+        -- individual PRAGMA overrides on top of the profile, e.g. 'cache_size=-2000'
+        local profile = { base = config.persistency_profile }
+        local pragmas = uci_config.dbpragmas
+        if type(pragmas) ~= "table" then
+          pragmas = { pragmas }
+        end
+        for _, pragma in ipairs(pragmas) do
+          local name, value = pragma:match("^([%w_]+)=(.+)$")
+          if name then
+            profile[name] = value
+          else
+            -- reported when the profile is applied
+            profile[pragma] = false
+          end
+        end
+        config.persistency_profile = profile
+      end
+      if uci_config.mapcache then
+        config.mapcache = uci_config.mapcache
+      end
+      if uci_config.lazy_maps then
+        config.lazy_maps = (tonumber(uci_config.lazy_maps) == 1)
+      end
+      if uci_config.event_queue_size then
+        config.event_queue_size = tonumber(uci_config.event_queue_size)
+      end
+      if uci_config.event_overflow then
+        config.event_overflow = uci_config.event_overflow
+      end
+      if uci_config.change_journal_size then
+        config.change_journal_size = tonumber(uci_config.change_journal_size)
+      end
+      if uci_config.metrics then
+        config.metrics = (tonumber(uci_config.metrics) == 1)
+      end
+      if uci_config.ubus_cache_ttl then
+        config.ubus_cache_ttl = tonumber(uci_config.ubus_cache_ttl)
+      end
+      if uci_config.trace_rate then
+        config.trace_rate = tonumber(uci_config.trace_rate)
+      end
+      if uci_config.trace_file then
+        config.trace_file = uci_config.trace_file
+      end
+      if uci_config.uci_cache_budget then
+        config.uci_cache_budget = tonumber(uci_config.uci_cache_budget)
+      end
       if uci_config.log_level then
         config.log_level = tonumber(uci_config.log_level)
       end
@@ -77,6 +142,20 @@ do
     commitpath = '/usr/share/transformer/commitapply',
     persistency_location = '/etc',
     persistency_name = 'transformer.db',
+    persistency_profile = 'default',
+    persistency_workdir = nil,
+    mapcache = nil,  -- map snapshot file; maps are fully reloaded on every start when not set
+    lazy_maps = false,  -- load map files on first use; needs mapcache
+    checkpoint_idle = 5,  -- seconds without requests before checkpointing
+    checkpoint_interval = 300,  -- seconds between checkpoints while busy
+    event_queue_size = 64,  -- event datagrams queued per slow subscriber
+    event_overflow = 'drop_oldest',
+    change_journal_size = 1024,  -- changes remembered for delta GPV
+    uci_cache_budget = nil,  -- bytes of UCI configs kept loaded; unbounded by default
+    metrics = true,  -- measure request, mapping and database latencies
+    ubus_cache_ttl = 0,  -- milliseconds; 0 only reuses ubus call results within a read request
+    trace_rate = 0,  -- fraction of the requests to trace; 0 disables tracing
+    trace_file = '/tmp/transformer/trace.json',  -- its directory must only be writable by us
     log_level = 3,
     log_stderr = false,
     ignore_patterns = nil,
@@ -84,6 +163,9 @@ do
     unhide_patterns = nil,
   }
   config = do_config(config)
+  metrics.enable(config.metrics)
+  tracer.configure(config.trace_file, config.trace_rate)
+  ubus_cache_ttl = config.ubus_cache_ttl or 0
   logger.init("transformer", config.log_level, posix.LOG_PID + (config.log_stderr and posix.LOG_PERROR or 0))
   local api = require("transformer.api")
   local errmsg
@@ -93,6 +175,15 @@ do
     return
   end
   api.init = nil  -- we won't call init() anymore so allow the code to be GC'd
+  if config.uci_cache_budget then
+    require("transformer.mapper.ucihelper").set_cache_budget(config.uci_cache_budget)
+  end
+  if config.persistency_workdir then
+    checkpoint_config = {
+      idle = config.checkpoint_idle * 1000,
+      interval = config.checkpoint_interval * 1000,
+    }
+  end
 end
 
 local fault = require("transformer.fault")
@@ -111,11 +202,26 @@ local UNSUBSCRIBE_RESP = tags.UNSUBSCRIBE_RESP
 local GPL_RESP = tags.GPL_RESP
 local GPC_RESP = tags.GPC_RESP
 local GPV_NO_ABORT_RESP = tags.GPV_NO_ABORT_RESP
+local GPV_DELTA_RESP = tags.GPV_DELTA_RESP
+local METRICS_RESP = tags.METRICS_RESP
+
+-- the names of the tags, to report the measurements per request type
+local tag_names = {}
+for name, tag in pairs(tags) do
+  tag_names[tag] = name
+end
+
+-- encoding time and number of datagrams sent for the current request
+local encode_time = 0
+local datagrams = 0
+local now = metrics.now
 
 local tch_evloop = require("tch.socket.evloop")
 local tch_timerfd = require("tch.timerfd")
 
 local function sendto(sk, msg, from)
+  datagrams = datagrams + 1
+  local start = tracer.active and now()
   local ok, errmsg = sk:sendto(msg:retrieve_data(), from)
   if not ok and errmsg == "WOULDBLOCK" then
     -- The sending queue of our socket is full. Create an evloop so we
@@ -146,9 +252,13 @@ local function sendto(sk, msg, from)
   if not ok then
     logger:critical("Sendto %s failed: %s. Dropping datagram.", from, tostring(errmsg))
   end
+  if start then
+    tracer.span("send", "sendto", start)
+  end
 end
 
 local function encode_wrapper(type, sk, from, ...)
+  local start = metrics.enabled and now()
   local success = msg:encode(...)
   if not success then
     -- The additional data does not fit in the dgram.
@@ -161,6 +271,9 @@ local function encode_wrapper(type, sk, from, ...)
       error("Too much data to fit in one single dgram.")
     end
   end
+  if start then
+    encode_time = encode_time + (now() - start)
+  end
 end
 
 local GPV_cb_env = {}
@@ -218,6 +331,59 @@ local function handle_GPV_NO_ABORT(sk, from, uuid, req)
   sendto(sk, msg, from)
 end
 
+local GPV_DELTA_cb_env = {}
+local function GPV_DELTA_cb(ppath, pname, pvalue, ptype)
+  encode_wrapper(GPV_DELTA_RESP, sk, from, 0, ppath, pname, pvalue, ptype)
+end
+setfenv(GPV_DELTA_cb, GPV_DELTA_cb_env)
+
+local function GPV_DELTA_deleted_cb(path)
+  encode_wrapper(GPV_DELTA_RESP, sk, from, 1, path)
+end
+setfenv(GPV_DELTA_deleted_cb, GPV_DELTA_cb_env)
+
+local function handle_GPV_DELTA(sk, from, uuid, req)
+  -- prepare environment for the GPV_DELTA callbacks
+  GPV_DELTA_cb_env.sk = sk
+  GPV_DELTA_cb_env.from = from
+  msg:init_encode(GPV_DELTA_RESP, max_size)
+  -- do GPV for each path we received, only reporting the changes since the token
+  -- on success the second return value tells whether all values were reported,
+  -- otherwise it's the error code
+  local token, full_or_errcode, errmsg = transformer:getParameterValuesDelta(uuid, req.token, req,
+                                                                             GPV_DELTA_cb, GPV_DELTA_deleted_cb)
+  if token then
+    -- the new token is the last record
+    encode_wrapper(GPV_DELTA_RESP, sk, from, 2, token, full_or_errcode)
+  else
+    -- an error occurred: discard any data already queued, send an
+    -- error message to the client and stop the GPV_DELTA
+    msg:init_encode(ERROR, max_size)
+    msg:encode(full_or_errcode, errmsg)
+  end
+  -- send any data still left in the buffer with the 'last' flag set
+  msg:mark_last()
+  sendto(sk, msg, from)
+end
+
+local function handle_GPV_FILTER(sk, from, uuid, req)
+  -- prepare environment for GPV callback
+  GPV_cb_env.sk = sk
+  GPV_cb_env.from = from
+  msg:init_encode(GPV_RESP, max_size)
+  -- do GPV for each path we received, keeping only what passes the filter
+  local rc, errcode, errmsg = transformer:getFilteredParameterValues(uuid, req, req.params, req.filter, GPV_cb)
+  if not rc then
+    -- an error occurred: discard any data already queued, send an
+    -- error message to the client and stop the GPV
+    msg:init_encode(ERROR, max_size)
+    msg:encode(errcode, errmsg)
+  end
+  -- send any data still left in the buffer with the 'last' flag set
+  msg:mark_last()
+  sendto(sk, msg, from)
+end
+
 local function handle_SPV(sk, from, uuid, req)
   local ok, errors = transformer:setParameterValues(uuid, req)
   msg:init_encode(SPV_RESP, max_size)
@@ -307,7 +473,8 @@ local function handle_RES(sk, from, uuid, req)
 end
 
 local function handle_SUB(sk, from, uuid, req)
-  local id, paths, errmsg = transformer:subscribe(uuid, req.path, req.address, req.subscription, req.options)
+  local id, paths, errmsg = transformer:subscribe(uuid, req.path, req.address, req.subscription, req.options,
+                                                req.min_interval)
   local data, datasize
   if not id then
     -- send ERROR message
@@ -390,6 +557,18 @@ local function handle_GPC(sk, from, uuid, req)
   sendto(sk, msg, from)
 end
 
+local function handle_METRICS(sk, from, uuid, req)
+  msg:init_encode(METRICS_RESP, max_size)
+  for _, m in ipairs(metrics.snapshot()) do
+    encode_wrapper(METRICS_RESP, sk, from, m)
+  end
+  if req.reset then
+    metrics.reset()
+  end
+  msg:mark_last()
+  sendto(sk, msg, from)
+end
+
 local function handle_unknown(sk, from)
   msg:init_encode(ERROR, max_size)
   msg:encode(fault.INTERNAL_ERROR, "unsupported tag")
@@ -411,6 +590,9 @@ local handlers = {
   [tags.GPL_REQ] = handle_GPL,
   [tags.GPC_REQ] = handle_GPC,
   [tags.GPV_NO_ABORT_REQ] = handle_GPV_NO_ABORT,
+  [tags.GPV_DELTA_REQ] = handle_GPV_DELTA,
+  [tags.GPV_FILTER_REQ] = handle_GPV_FILTER,
+  [tags.METRICS_REQ] = handle_METRICS,
   __index        = function()
     return handle_unknown
   end
@@ -434,13 +616,169 @@ end
 local trlock = require("transformer.lock").Lock("transformer")
 local ucihelper = require("transformer.mapper.ucihelper")
 
+-- requests that don't change the datamodel; results of ubus call_cached() calls
+-- made by the mappings can be reused while handling them
+local read_only = {
+  [tags.GPV_REQ] = true,
+  [tags.GPV_NO_ABORT_REQ] = true,
+  [tags.GPV_DELTA_REQ] = true,
+  [tags.GPV_FILTER_REQ] = true,
+  [tags.GPN_REQ] = true,
+  [tags.GPL_REQ] = true,
+  [tags.GPC_REQ] = true,
+  [tags.RESOLVE_REQ] = true,
+}
+
+-- The UCI event source is only loaded once a mapping watches UCI.
+local function uci_eventsource_start()
+  local uci_evsrc = package.loaded["transformer.eventsource.uci"]
+  if uci_evsrc then
+    uci_evsrc.start()
+  end
+end
+
+-- The ubus helper is only loaded once a mapping needs it; there's
+-- nothing to cache before that.
+local function ubus_start(tag)
+  local ubushelper = package.loaded["transformer.mapper.ubus"]
+  if ubushelper then
+    ubushelper.start(read_only[tag] and ubus_cache_ttl or nil)
+  end
+end
+
+local function ubus_finish()
+  local ubushelper = package.loaded["transformer.mapper.ubus"]
+  if ubushelper then
+    ubushelper.finish()
+  end
+end
+
+-- counters maintained by other modules, reported with the measurements
+metrics.addSource("uci_cache", ucihelper.cache_stats)
+metrics.addSource("lazy_maps", function()
+  return transformer:lazyStats()
+end)
+metrics.addSource("events", function()
+  local totals = { subscribers = 0, queued = 0, sent = 0, dropped = 0, resyncs = 0 }
+  for _, stats in pairs(transformer:eventStats()) do
+    totals.subscribers = totals.subscribers + 1
+    for name, value in pairs(stats) do
+      if totals[name] then
+        totals[name] = totals[name] + value
+      end
+    end
+  end
+  return totals
+end)
+
+-- When the database runs on a working copy it is checkpointed to its
+-- persistent location once no requests came in for a while, periodically
+-- while requests keep coming in and when the event loop stops.
+-- The timers only flag that a checkpoint is due; it's done through the
+-- lock so it never happens in the middle of processing a request.
+local checkpoint_due = false
+local idle_timer
+
+local function checkpoint()
+  local ok, _, errmsg = transformer:checkpoint()
+  if not ok and errmsg then
+    logger:error("database checkpoint failed: %s", tostring(errmsg))
+  end
+end
+
+trlock:set_listener("checkpoint", function()
+  if checkpoint_due then
+    checkpoint_due = false
+    checkpoint()
+  end
+end)
+
+local function request_checkpoint()
+  checkpoint_due = true
+  trlock:notify()
+end
+
+if checkpoint_config then
+  -- also checkpoint whatever changed during startup
+  idle_timer = uloop.timer(request_checkpoint, checkpoint_config.idle)
+  local interval_timer
+  interval_timer = uloop.timer(function()
+    request_checkpoint()
+    interval_timer:set(checkpoint_config.interval)
+  end, checkpoint_config.interval)
+  -- keep a reference so the timer isn't garbage collected
+  checkpoint_config.interval_timer = interval_timer
+end
+
+-- UCI config change notifications are also read through the lock so the
+-- loaded configs are never invalidated in the middle of a request.
+local uci_changes  -- the uloop watch on the notifications
+local uci_changes_due = false
+
+trlock:set_listener("uci_changes", function()
+  if uci_changes_due then
+    uci_changes_due = false
+    if not ucihelper.process_changes() and uci_changes then
+      -- the notifications can no longer be relied on
+      uci_changes:delete()
+      uci_changes = nil
+    end
+  end
+end)
+
+local function uci_changed()
+  uci_changes_due = true
+  trlock:notify()
+end
+
+-- Events for subscriptions with a minimum interval are held back with
+-- a timer. Keep a reference to the pending timers so they aren't garbage
+-- collected before they expire.
+local event_timers = {}
+transformer:setEventScheduler(function(callback, delay)
+  local timer
+  timer = uloop.timer(function()
+    event_timers[timer] = nil
+    callback()
+  end, delay)
+  event_timers[timer] = true
+end)
+transformer:setEventWriteWatcher(function(fd, callback)
+  return uloop.fd_add(fd, callback, uloop.ULOOP_WRITE)
+end)
+
+local function handle_request(tag, from, uuid, req)
+  if metrics.enabled then
+    local name = tag_names[tag] or "unknown"
+    local start = now()
+    handlers[tag](sk, from, uuid, req)
+    metrics.record("request", name, now() - start)
+    metrics.record("encode", name, encode_time)
+    metrics.add("datagrams", name, datagrams)
+  else
+    handlers[tag](sk, from, uuid, req)
+  end
+end
+
 local function recv_msg()
+  local recv_start = tracer.enabled and now()
   local data, from = sk:recvfrom()
   if not data then
     return false
   end
+  local traced = recv_start and tracer.start(recv_start)
+  local decode_start
+  if traced then
+    tracer.span("recv", "recvfrom", recv_start)
+    decode_start = now()
+  end
   local tag, is_last, uuid = msg:init_decode(data)
   local req = msg:decode()
+  if traced then
+    tracer.span("decode", tag_names[tag] or "unknown", decode_start)
+  end
+  encode_time = 0
+  datagrams = 0
   -- Note: we're currently assuming that all requests
   -- fit in one message. If not, this would complicate
   -- the handling logic quite a bit: the next call to
@@ -451,7 +789,22 @@ local function recv_msg()
     handle_unknown(sk, from)
   else
     ucihelper.start()
-    handlers[tag](sk, from, uuid, req)
+    uci_eventsource_start()
+    ubus_start(tag)
+    -- the ubus call results must not be reused after the request, also
+    -- when handling it raised an error
+    local ok, err = pcall(handle_request, tag, from, uuid, req)
+    ubus_finish()
+    if not ok then
+      error(err, 0)
+    end
+    if idle_timer then
+      idle_timer:set(checkpoint_config.idle)
+    end
+  end
+  if traced then
+    -- encoding is interleaved with the navigation so it's reported as a total
+    tracer.stop(tag_names[tag] or "unknown", { encode_us = floor(encode_time * 1e6), datagrams = datagrams })
   end
   return true
 end
@@ -493,6 +846,11 @@ local function main()
   -- is removed from uloop
   -- Use edge trigger to avoid recursive calls to the callback.
   local usock = uloop.fd_add(sk:fd(), sk_callback, uloop.ULOOP_READ + uloop.ULOOP_EDGE_TRIGGER)
+  -- keep track of UCI config changes made by others
+  -- Use edge trigger since the notifications are only read once the
+  -- lock is released.
+  local uci_changes_fd = ucihelper.change_fd()
+  uci_changes = uci_changes_fd and uloop.fd_add(uci_changes_fd, uci_changed, uloop.ULOOP_READ + uloop.ULOOP_EDGE_TRIGGER)
 
   rcv_error = nil
 
@@ -501,6 +859,14 @@ local function main()
 
   -- when done, remove the socket from uloop
   usock:delete()
+  if uci_changes then
+    uci_changes:delete()
+    uci_changes = nil
+  end
+
+  if checkpoint_config then
+    checkpoint()
+  end
 
   if rcv_error then
     error(rcv_error)
@@ -0,0 +1,203 @@
+--[[
+Copyright (c) 2016 Technicolor Delivery Technologies, SAS
+
+The source code form of this Transformer component is subject
+to the terms of the Clear BSD license.
+
+You can redistribute it and/or modify it under the terms of the
+Clear BSD License (http://directory.fsf.org/wiki/License:ClearBSD)
+
+See LICENSE file for more details.
+]]
+
+--- Sampling tracer of the request processing.
+-- For a fraction of the requests the time spent receiving, decoding,
+-- navigating, in the mappings, on ubus, synchronizing, in the database and
+-- sending is recorded as spans. The spans of every traced request are
+-- appended to a file in the Chrome trace event format so it can be opened in
+-- a trace viewer (chrome://tracing, Perfetto, ...). The file is an array of
+-- events without the closing bracket, which these viewers accept.
+-- The instrumented code checks `M.active` before it takes a time stamp so
+-- nothing is measured for requests that are not traced.
+-- @module transformer.tracer
+local M = {
+  enabled = false,  -- true if requests are sampled
+  active = false,  -- true while a sampled request is processed
+}
+
+local open, rename, random, randomseed, time =
+      io.open, os.rename, math.random, math.randomseed, os.time
+local format, gsub, byte, match = string.format, string.gsub, string.byte, string.match
+local concat = table.concat
+local floor = math.floor
+local pairs, type, tostring = pairs, type, tostring
+
+local logger = require("tch.logger")
+local private_dir = require("lfsync").private_dir
+local metrics = require("transformer.metrics")
+local now = metrics.now
+
+local config = {
+  file = nil,
+  rate = 0,
+  max_size = 1024 * 1024,
+  max_events = 10000,  -- spans kept per request
+}
+
+-- the events of the request being traced
+local events = {}
+local dropped = 0
+local request_start
+
+-- the measurements of these groups are added as spans
+local span_groups = {
+  get = "mapping",
+  getall = "mapping",
+  set = "mapping",
+  sync = "sync",
+  sql = "db",
+  ubus = "ubus",
+}
+
+local escapes = {
+  ['"'] = '\\"',
+  ['\\'] = '\\\\',
+  ['\n'] = '\\n',
+  ['\t'] = '\\t',
+}
+
+local function json_string(s)
+  return '"' .. gsub(tostring(s), '[%c"\\]', function(c)
+    return escapes[c] or format("\\u%04x", byte(c))
+  end) .. '"'
+end
+
+local function to_us(seconds)
+  return floor(seconds * 1e6 + 0.5)
+end
+
+--- Add a span to the trace of the current request.
+-- @param #string cat The category of the span (e.g. "mapping").
+-- @param #string name The name of the span.
+-- @param #number start The start time as returned by `metrics.now()`.
+-- @param #number elapsed (optional) The duration in seconds; defaults to
+--   the time since `start`.
+-- @param #table args (optional) Extra information about the span, as a
+--   table with string keys and string or number values.
+function M.span(cat, name, start, elapsed, args)
+  if #events >= config.max_events then
+    dropped = dropped + 1
+    return
+  end
+  elapsed = elapsed or (now() - start)
+  local extra = ""
+  if args then
+    local fields = {}
+    for k, v in pairs(args) do
+      fields[#fields + 1] = json_string(k) .. ":" .. (type(v) == "number" and v or json_string(v))
+    end
+    extra = ',"args":{' .. concat(fields, ",") .. '}'
+  end
+  events[#events + 1] = format('{"name":%s,"cat":"%s","ph":"X","ts":%d,"dur":%d,"pid":1,"tid":1%s}',
+                               json_string(name), cat, to_us(start), to_us(elapsed), extra)
+end
+
+local span = M.span
+
+-- called for every measurement while a request is traced
+local function measured(group, name, elapsed)
+  local cat = span_groups[group]
+  if cat then
+    span(cat, group .. " " .. name, now() - elapsed, elapsed)
+  end
+end
+
+local function write_events()
+  local f, errmsg = open(config.file, "a")
+  if not f then
+    logger:error("can't write trace to %s: %s", config.file, errmsg)
+    return
+  end
+  local size = f:seek("end")
+  if size >= config.max_size then
+    -- keep the previous trace next to the new one
+    f:close()
+    rename(config.file, config.file .. ".old")
+    f, errmsg = open(config.file, "a")
+    if not f then
+      logger:error("can't write trace to %s: %s", config.file, errmsg)
+      return
+    end
+    size = 0
+  end
+  if size == 0 then
+    f:write('[{"name":"process_name","ph":"M","pid":1,"args":{"name":"transformer"}},\n')
+  end
+  f:write(concat(events, ",\n"), ",\n")
+  f:close()
+end
+
+--- Configure the tracer.
+-- @param #string file The file to write the traces to; it's meant to be on a
+--   tmpfs. Nothing is traced when this is nil. The directory it's in is
+--   created if needed and must only be writable by the current user, so no
+--   one can redirect the trace with a symlink; if it isn't nothing is traced.
+-- @param #number rate The fraction (between 0 and 1) of the requests that
+--   are traced. Nothing is traced when this is 0 or nil.
+-- @param #number max_size (optional) When the file grows beyond this number
+--   of bytes it's renamed with a '.old' suffix and a new file is started.
+function M.configure(file, rate, max_size)
+  if file then
+    local ok, errmsg = private_dir(match(file, "^(.*)/[^/]*$") or ".")
+    if not ok then
+      logger:error("not tracing to %s: %s", file, errmsg)
+      file = nil
+    end
+  end
+  config.file = file
+  config.rate = rate or 0
+  config.max_size = max_size or config.max_size
+  M.enabled = (file ~= nil and config.rate > 0)
+  if M.enabled then
+    randomseed(time())
+  end
+end
+
+--- Decide whether the request that was received at the given time is traced.
+-- If so, the tracer is active until `stop()` is called.
+-- @param #number start The time the processing of the request started, as
+--   returned by `metrics.now()`.
+-- @return #boolean True if the request is traced.
+function M.start(start)
+  if not M.enabled or random() >= config.rate then
+    return false
+  end
+  events = {}
+  dropped = 0
+  request_start = start
+  M.active = true
+  metrics.setListener(measured)
+  return true
+end
+
+--- Finish the trace of the current request and write it out.
+-- @param #string name The name of the request.
+-- @param #table args (optional) Extra information about the request.
+function M.stop(name, args)
+  if not M.active then
+    return
+  end
+  M.active = false
+  metrics.setListener(nil)
+  if dropped > 0 then
+    args = args or {}
+    args.dropped_spans = dropped
+    -- make room for the span of the request itself
+    events[#events] = nil
+  end
+  span("request", name, request_start, nil, args)
+  write_events()
+  events = {}
+end
+
+return M
@@ -13,10 +13,11 @@ See LICENSE file for more details.
 -- This module implements type checking for parameters
 
 local floor = math.floor
-local error, tonumber, tostring, type, pairs =
-      error, tonumber, tostring, type, pairs
-local format, find, gsub, sub =
-string.format, string.find, string.gsub, string.sub
+local error, tonumber, tostring, type, pairs, setmetatable =
+      error, tonumber, tostring, type, pairs, setmetatable
+local format, find, gsub, sub, match, gmatch =
+string.format, string.find, string.gsub, string.sub, string.match, string.gmatch
+local concat = table.concat
 
 local fault = require 'transformer.fault'
 
@@ -39,76 +40,77 @@ local function retrieveRoot(path)
   return path:match("^[^.]+%.")
 end
 
---- handle a single string.
--- The type of the first argument should already be verified
--- to be a string before calling this method.
--- return value
-local function single_string_value(value, paramInfo, fullPath)
-  if paramInfo["min"] then
-    local minLength = tonumber(paramInfo["min"])
+--- Compile the check of a single string.
+-- The type of the value should already be verified to be a string before
+-- calling the returned function.
+-- @return A function taking the value and the full path of the parameter
+--   and returning the value.
+local function single_string_value(paramInfo)
+  local minLength = paramInfo["min"] and tonumber(paramInfo["min"])
+  local maxLength = paramInfo["max"] and tonumber(paramInfo["max"])
+  local enumeration
+  if paramInfo["enumeration"] then
+    enumeration = {}
+    for _,entry in pairs(paramInfo["enumeration"]) do
+      enumeration[entry] = true
+    end
+  end
+  local pathRef = paramInfo["pathRef"]
+  local targetParent = paramInfo["targetParent"]
+  local targetPattern = targetParent and "^"..targetParent
+  return function(value, fullPath)
     if minLength and minLength > #value then
       fault.InvalidValue("string '%s' is too short (minimum %d)", value, minLength)
     end
-  end
-  if paramInfo["max"] then
-    local maxLength = tonumber(paramInfo["max"])
     if maxLength and maxLength < #value then
       fault.InvalidValue("string '%s' is too long (maximum %d)", value, maxLength)
     end
-  end
-  if paramInfo["enumeration"] then
-    local found = false
-    for _,entry in pairs(paramInfo["enumeration"]) do
-      if entry == value then
-        found = true
-      end
-    end
-    if not found then
+    if enumeration and not enumeration[value] then
       fault.InvalidValue("string '%s' is not a valid entry of the enumeration", value)
     end
-  end
-  if paramInfo["pathRef"] and value ~= "" then
-    if retrieveRoot(value) ~= retrieveRoot(fullPath) then
-      fault.InvalidValue("string '%s' is not a valid path reference", value)
-    end
-    if paramInfo["targetParent"] then
-      local typepath = value:gsub("%.%d+%.", ".{i}.")
-      typepath = typepath:gsub("%.%d+$", ".{i}.")
-      if not typepath:match("^"..paramInfo["targetParent"]) then
-        fault.InvalidValue("string '%s' does not reference a correct path %s", value, paramInfo["targetParent"])
+    if pathRef and value ~= "" then
+      if retrieveRoot(value) ~= retrieveRoot(fullPath) then
+        fault.InvalidValue("string '%s' is not a valid path reference", value)
+      end
+      if targetPattern then
+        local typepath = gsub(value, "%.%d+%.", ".{i}.")
+        typepath = gsub(typepath, "%.%d+$", ".{i}.")
+        if not find(typepath, targetPattern) then
+          fault.InvalidValue("string '%s' does not reference a correct path %s", value, targetParent)
+        end
       end
+      -- Note that the actual path is not checked for existence. This is because
+      -- some references are weak and do not have to exist when they are created.
     end
-    -- Note that the actual path is not checked for existence. This is because
-    -- some references are weak and do not have to exist when they are created.
+    return value
   end
-  return value
 end
 
-local function single_hexBinary_value(value, paramInfo, fullPath)
-  -- string may contain only hex characters
-  if value:match('%X+') then
-    fault.InvalidValue("hexBinary '%s' is not valid, contains non hex characters", value)
-  end
-  local plen = #value
-  -- length must be even
-  if plen%2 ~= 0 then
-    fault.InvalidValue("hexBinary '%s' is not a valid, length not even", value)
-  end
-  if paramInfo.min then
-    -- min is the number of actual bytes, the length in hexBinary is twice that value
-    local minLength = tonumber(paramInfo.min)*2
-    if plen<minLength then
+--- Compile the check of a single hexBinary value.
+local function single_hexBinary_value(paramInfo)
+  -- min and max are the number of actual bytes, the length in hexBinary is twice that value
+  local minLength = paramInfo.min and tonumber(paramInfo.min)
+  minLength = minLength and minLength*2
+  local maxLength = paramInfo.max and tonumber(paramInfo.max)
+  maxLength = maxLength and maxLength*2
+  return function(value)
+    -- string may contain only hex characters
+    if find(value, '%X') then
+      fault.InvalidValue("hexBinary '%s' is not valid, contains non hex characters", value)
+    end
+    local plen = #value
+    -- length must be even
+    if plen%2 ~= 0 then
+      fault.InvalidValue("hexBinary '%s' is not a valid, length not even", value)
+    end
+    if minLength and plen<minLength then
       fault.InvalidValue("hexBinary '%s' is too short (minimum=%d)", value, minLength)
     end
-  end
-  if paramInfo.max then
-    -- max is the number of actual bytes, the length in hexBinary is twice that value
-    local maxLength = tonumber(paramInfo.max)*2
-    if maxLength<plen then
+    if maxLength and maxLength<plen then
       fault.InvalidValue("hexBinary '%s' is too long (maximum=%d)", value, maxLength)
     end
+    return value
   end
-  return value
 end
 
 local STR_FALSE = '0'
@@ -133,135 +135,124 @@ local function boolean_value(value, paramInfo)
   return v
 end
 
---- handle a single unsigned value.
--- return value
-local function single_unsigned_value(value, paramInfo)
-  local n = tonumber(value)
-  if not n or floor(n)~=n or 0>n then
-    fault.InvalidType("'%s' is not a valid unsigned value", tostring(value))
-  end
-  if paramInfo.type == "unsignedInt" and n > 4294967295 then
-    fault.InvalidValue("'%s' is out of unsignedInt range", tostring(value))
-  end
-  if paramInfo["range"] and type(paramInfo["range"]) == 'table' then
-    local inRange = false
-    local message = format("unsigned value '%d' not in range ",n)
-    -- Multiple ranges are possible, find one that is correct
-    for _,v in pairs(paramInfo["range"]) do
-      local correct = true
-      local rangeMessage = "["
-      if v["min"] then
-        local minLength = tonumber(v["min"])
-        if minLength and minLength > n then
-          correct = false
-        end
-        rangeMessage = rangeMessage..minLength
-      end
-      rangeMessage = rangeMessage..","
-      if v["max"] then
-        local maxLength = tonumber(v["max"])
-        if maxLength and maxLength < n then
-          correct = false
-        end
-        rangeMessage = rangeMessage..maxLength
-      end
-      rangeMessage = rangeMessage.."]"
-      inRange = inRange or correct
-      message = message..rangeMessage
+--- Parse the ranges of a numeric parameter.
+-- @return An array with the bounds of every range and the part of the
+--   error message listing the ranges, or nil if there are no ranges.
+local function parse_ranges(paramInfo)
+  local range = paramInfo["range"]
+  if not range or type(range) ~= 'table' then
+    return nil
+  end
+  local ranges = {}
+  local message = ""
+  for _,v in pairs(range) do
+    local bounds = {}
+    local rangeMessage = "["
+    if v["min"] then
+      bounds.min = tonumber(v["min"])
+      rangeMessage = rangeMessage..(bounds.min or tostring(v["min"]))
     end
-    if not inRange then
-      fault.InvalidValue(message)
+    rangeMessage = rangeMessage..","
+    if v["max"] then
+      bounds.max = tonumber(v["max"])
+      rangeMessage = rangeMessage..(bounds.max or tostring(v["max"]))
     end
+    rangeMessage = rangeMessage.."]"
+    ranges[#ranges + 1] = bounds
+    message = message..rangeMessage
   end
-  return tostring(n)
+  return ranges, message
 end
 
---- handle a single integer value.
--- return value
-local function single_integer_value(value, paramInfo)
-  local n = tonumber(value)
-  if not n or floor(n)~=n then
-    fault.InvalidType("'%s' is not a valid integer", tostring(value))
+--- Check whether the given number is in one of the given ranges.
+local function in_ranges(n, ranges)
+  -- Multiple ranges are possible, find one that is correct
+  for i = 1, #ranges do
+    local bounds = ranges[i]
+    local min, max = bounds.min, bounds.max
+    if not (min and min > n) and not (max and max < n) then
+      return true
+    end
   end
-  if paramInfo["range"] and type(paramInfo["range"]) == 'table' then
-    local inRange = false
-    local message = format("integer value '%d' not in range ",n)
-    -- Multiple ranges are possible, find one that is correct
-    for _,v in pairs(paramInfo["range"]) do
-      local correct = true
-      local rangeMessage = "["
-      if v["min"] then
-        local minLength = tonumber(v["min"])
-        if minLength and minLength > n then
-          correct = false
-        end
-        rangeMessage = rangeMessage..minLength
-      end
-      rangeMessage = rangeMessage..","
-      if v["max"] then
-        local maxLength = tonumber(v["max"])
-        if maxLength and maxLength < n then
-          correct = false
-        end
-        rangeMessage = rangeMessage..maxLength
-      end
-      rangeMessage = rangeMessage.."]"
-      inRange = inRange or correct
-      message = message..rangeMessage
+  return false
+end
+
+--- Compile the check of a single unsigned value.
+local function single_unsigned_value(paramInfo)
+  local ranges, rangesMessage = parse_ranges(paramInfo)
+  local limit = (paramInfo.type == "unsignedInt") and 4294967295
+  return function(value)
+    local n = tonumber(value)
+    if not n or floor(n)~=n or 0>n then
+      fault.InvalidType("'%s' is not a valid unsigned value", tostring(value))
     end
-    if not inRange then
-      fault.InvalidValue(message)
+    if limit and n > limit then
+      fault.InvalidValue("'%s' is out of unsignedInt range", tostring(value))
     end
+    if ranges and not in_ranges(n, ranges) then
+      fault.InvalidValue(format("unsigned value '%d' not in range ",n)..rangesMessage)
+    end
+    return tostring(n)
   end
-  return tostring(n)
 end
 
---- handle base64 value
--- @return value
-local function single_base64_value(value, paramInfo)
-  -- Base64 should support 65 characters ('a-z', 'A-Z', '0-9', '/', '+' and '=') also white_space.
-  -- Base64 should support empty string.
-  if not value:match("^[%w%s/+=]+$") and value ~= "" then
-    fault.InvalidValue("base64 '%s' is not valid, contains non base64 characters", value)
-  end
-  -- Convert value to canonical form for further validation.
-  value = value:gsub("%s","")
-  -- Number of non-whitespaces must be multiple of '4'.
-  local nlen = #value
-  if nlen%4 ~= 0 then
-    fault.InvalidValue("base64 '%s' is not valid length, '%d' non-whitespace most multiple of four", value, nlen)
-  end
-  local padding1, padding2 = value:match("^[^=]*(=?)(=?)$")
-  -- In base64 encoding equal signs are used as padding and can only occur at the last 2 positions of the string.
-  if not padding1 then
-    fault.InvalidValue("base64 '%s' is not valid, illegal position for equal sign", value)
-  end
-  -- Strip padding equal sign characters at end of base64 string.
-  if padding2 == "=" then
-    nlen = nlen - 2
-  elseif padding1 == "=" then
-    nlen = nlen - 1
+--- Compile the check of a single integer value.
+local function single_integer_value(paramInfo)
+  local ranges, rangesMessage = parse_ranges(paramInfo)
+  return function(value)
+    local n = tonumber(value)
+    if not n or floor(n)~=n then
+      fault.InvalidType("'%s' is not a valid integer", tostring(value))
+    end
+    if ranges and not in_ranges(n, ranges) then
+      fault.InvalidValue(format("integer value '%d' not in range ",n)..rangesMessage)
+    end
+    return tostring(n)
   end
-  -- Calculation of number of octets of base64 encoded value.
-  local num_octet = floor((nlen*3)/4)
-  if paramInfo.min then
-    -- 'min' is the minimum length of actual base64 encoded representation.
-    local minLength = tonumber(paramInfo.min)
-    if num_octet < minLength then
+end
+
+--- Compile the check of a single base64 value.
+local function single_base64_value(paramInfo)
+  -- 'min' and 'max' are the lengths of actual base64 encoded representation.
+  local minLength = paramInfo.min and tonumber(paramInfo.min)
+  local maxLength = paramInfo.max and tonumber(paramInfo.max)
+  return function(value)
+    -- Base64 should support 65 characters ('a-z', 'A-Z', '0-9', '/', '+' and '=') also white_space.
+    -- Base64 should support empty string.
+    if not find(value, "^[%w%s/+=]+$") and value ~= "" then
+      fault.InvalidValue("base64 '%s' is not valid, contains non base64 characters", value)
+    end
+    -- Convert value to canonical form for further validation.
+    value = gsub(value, "%s","")
+    -- Number of non-whitespaces must be multiple of '4'.
+    local nlen = #value
+    if nlen%4 ~= 0 then
+      fault.InvalidValue("base64 '%s' is not valid length, '%d' non-whitespace most multiple of four", value, nlen)
+    end
+    local padding1, padding2 = value:match("^[^=]*(=?)(=?)$")
+    -- In base64 encoding equal signs are used as padding and can only occur at the last 2 positions of the string.
+    if not padding1 then
+      fault.InvalidValue("base64 '%s' is not valid, illegal position for equal sign", value)
+    end
+    -- Strip padding equal sign characters at end of base64 string.
+    if padding2 == "=" then
+      nlen = nlen - 2
+    elseif padding1 == "=" then
+      nlen = nlen - 1
+    end
+    -- Calculation of number of octets of base64 encoded value.
+    local num_octet = floor((nlen*3)/4)
+    if minLength and num_octet < minLength then
       fault.InvalidValue("base64 '%s' is too short (minimum=%d)", value, minLength)
     end
-  end
-  if paramInfo.max then
-    -- 'max' is the maximum length of actual base64 encoded representation.
-    local maxLength = tonumber(paramInfo.max)
-    if maxLength < num_octet then
+    if maxLength and maxLength < num_octet then
       fault.InvalidValue("base64 '%s' is too long (maximum=%d)", value, maxLength)
     end
+    return value
   end
-  return value
 end
 
-local function single_dateTime_value(value, paramInfo)
+local function check_dateTime(value)
   if not value:match("^[TZ%d%.:+-]+$") then
     fault.InvalidValue("dateTime '%s' is not valid, contains non dateTime characters", value)
   end
@@ -343,6 +334,11 @@ local function single_dateTime_value(value, paramInfo)
   return value
 end
 
+--- Compile the check of a single dateTime value.
+local function single_dateTime_value()
+  return check_dateTime
+end
+
 local singlemap = {
   string = single_string_value,
   unsigned_value = single_unsigned_value,
@@ -352,125 +348,98 @@ local singlemap = {
   dateTime = single_dateTime_value
 }
 
---- handle a single value
--- return the value
-local function single_value(value, paramInfo, paramType, fullPath)
+--- Compile the check of a single value.
+local function single_value(paramInfo, paramType)
   local single_checker = singlemap[paramType]
   if single_checker then
-    return single_checker(value, paramInfo, fullPath)
+    return single_checker(paramInfo)
+  end
+  return function()
+    fault.InvalidType("type %s is unsupported", paramType)
   end
-  fault.InvalidType("type %s is unsupported", paramType)
 end
 
---- handle a list of values (Only comma-separated allowed)
--- return the list
-local function list_value(list, paramInfo, paramType, fullPath)
-  local result = ""
-  if type(list)=='string' then
-    -- The min and max parameter attributes refer to the list and not the single
-    -- values. Remove from the parameter info table before passing it on.
-    if paramInfo["min"] then
-      local minLength = tonumber(paramInfo["min"])
-      if minLength and minLength > #list then
-        fault.InvalidValue("%s list '%s' is too short (minimum %d)", paramType, list, minLength)
-      end
+--- Compile the check of a list of values (Only comma-separated allowed).
+-- @return A function taking the list and the full path of the parameter
+--   and returning the list.
+local function list_value(paramInfo, paramType)
+  local minLength = paramInfo["min"] and tonumber(paramInfo["min"])
+  local maxLength = paramInfo["max"] and tonumber(paramInfo["max"])
+  local minItems = paramInfo["minItems"] and tonumber(paramInfo["minItems"])
+  local maxItems = paramInfo["maxItems"] and tonumber(paramInfo["maxItems"])
+  -- The min and max parameter attributes refer to the list and not the single
+  -- values. Remove from the parameter info table before compiling those.
+  local single = single_value(removeMinMax(paramInfo), paramType)
+  return function(list, fullPath)
+    if type(list)~='string' then
+      fault.InvalidType("'%s' is not a valid %s list", tostring(list), paramType)
     end
-    if paramInfo["max"] then
-      local maxLength = tonumber(paramInfo["max"])
-      if maxLength and maxLength < #list then
-        fault.InvalidValue("%s list '%s' is too long (maximum %d)", paramType, list, maxLength)
-      end
+    if minLength and minLength > #list then
+      fault.InvalidValue("%s list '%s' is too short (minimum %d)", paramType, list, minLength)
     end
-    local entries = 0
-    local subParamInfo = removeMinMax(paramInfo)
-    for single in list:gmatch("[^,]+") do
-      single = single:match("^%s*(.-)%s*$")
-      if result ~= "" then
-        result = result .. ","
-      end
-      result = result .. single_value(single, subParamInfo, paramType, fullPath)
-      entries = entries + 1
-    end
-    subParamInfo = nil
-    if paramInfo["maxItems"] then
-      local maxItems = tonumber(paramInfo["maxItems"])
-      if maxItems and maxItems < entries then
-        fault.InvalidValue("%s list '%s' has too many elements (maximum %d)", paramType, list, maxItems)
-      end
+    if maxLength and maxLength < #list then
+      fault.InvalidValue("%s list '%s' is too long (maximum %d)", paramType, list, maxLength)
     end
-    if paramInfo["minItems"] then
-      local minItems = tonumber(paramInfo["minItems"])
-      if minItems and minItems > entries then
-        fault.InvalidValue("%s list '%s' has too few elements (minimum %d)", paramType, list, minItems)
-      end
+    local result = {}
+    for entry in gmatch(list, "[^,]+") do
+      entry = match(entry, "^%s*(.-)%s*$")
+      result[#result + 1] = single(entry, fullPath)
+    end
+    local entries = #result
+    if maxItems and maxItems < entries then
+      fault.InvalidValue("%s list '%s' has too many elements (maximum %d)", paramType, list, maxItems)
     end
-    return result
+    if minItems and minItems > entries then
+      fault.InvalidValue("%s list '%s' has too few elements (minimum %d)", paramType, list, minItems)
+    end
+    return concat(result, ",")
   end
-  fault.InvalidType("'%s' is not a valid %s list", tostring(list), paramType)
 end
 
-local function any_value(value, paramInfo, paramType, fullPath)
+local function any_value(paramInfo, paramType)
   if paramInfo["list"] then
-    return list_value(value, paramInfo, paramType, fullPath)
+    return list_value(paramInfo, paramType)
   else
-    return single_value(value, paramInfo, paramType, fullPath)
+    return single_value(paramInfo, paramType)
   end
 end
 
---- handle string values
--- return value
-local function string_value(value, paramInfo, fullPath)
-  if type(value)=='string' then
-    return any_value(value, paramInfo, "string", fullPath)
+--- Compile the check of a value that must be given as a string.
+local function string_typed(paramType, typeName)
+  return function(paramInfo)
+    local check = any_value(paramInfo, paramType)
+    return function(value, fullPath)
+      if type(value)=='string' then
+        return check(value, fullPath)
+      end
+      fault.InvalidType("'%s' is not valid %s", tostring(value), typeName)
+    end
   end
-  fault.InvalidType("'%s' is not valid string", tostring(value))
 end
 
---- handle unsigned values
--- return value
-local function unsigned_value(value, paramInfo)
-  return any_value(value, paramInfo, "unsigned_value")
+--- compile the check of unsigned values
+local function unsigned_value(paramInfo)
+  return any_value(paramInfo, "unsigned_value")
 end
 
---- handle integer values
--- return value
-local function integer_value(value, paramInfo)
-  return any_value(value, paramInfo, "integer_value")
+--- compile the check of integer values
+local function integer_value(paramInfo)
+  return any_value(paramInfo, "integer_value")
 end
 
---- handle base64 value
--- return value
-local function base64_value(value, paramInfo, fullPath)
-  if type(value)=='string' then
-    return any_value(value, paramInfo, "base64", fullPath)
-  end
-  fault.InvalidType("'%s' is not valid base64", tostring(value))
+--- compile the check of boolean values
+local function boolean_checker()
+  return boolean_value
 end
 
---- handle dateTime value
--- return value
-local function dateTime_value(value, paramInfo, fullPath)
-  if type(value)=='string' then
-    return any_value(value, paramInfo, "dateTime", fullPath)
-  end
-  fault.InvalidType("'%s' is not valid dateTime", tostring(value))
-end
-
---- handle hexBinary value
--- return value
-local function hexBinary_value(value, paramInfo, fullPath)
-  if type(value)=='string' then
-    return any_value(value, paramInfo, "hexBinary", fullPath)
-  end
-  fault.InvalidType("'%s' is not valid hexBinary", tostring(value))
-end
+local string_value = string_typed("string", "string")
 
 local typemap = {
   string = string_value;
-  base64 = base64_value;
-  boolean = boolean_value;
-  dateTime = dateTime_value;
-  hexBinary = hexBinary_value;
+  base64 = string_typed("base64", "base64");
+  boolean = boolean_checker;
+  dateTime = string_typed("dateTime", "dateTime");
+  hexBinary = string_typed("hexBinary", "hexBinary");
   int = integer_value;
   long = integer_value;
   unsignedInt = unsigned_value;
@@ -478,6 +447,35 @@ local typemap = {
   password = string_value;
 }
 
+-- The compiled checks, per parameter info table.
+local compiled = setmetatable({}, { __mode = "k" })
+
+--- Compile the check of the values of a parameter.
+-- The check is remembered so it's only compiled once for every parameter
+-- info table; compiling the checks when the mappings are loaded avoids
+-- interpreting the parameter info on every set.
+-- @param paramInfo the parameter info from the objectType
+-- @return A function taking the value and the full path of the parameter
+--   that behaves as checkValue().
+function M.compile(paramInfo)
+  local check = compiled[paramInfo]
+  if not check then
+    local typename = paramInfo.type
+    local compiler = typemap[typename]
+    if compiler then
+      check = compiler(paramInfo)
+    else
+      check = function()
+        fault.InvalidType("type %s is unsupported", typename)
+      end
+    end
+    compiled[paramInfo] = check
+  end
+  return check
+end
+
+local compile = M.compile
+
 --- Check the validity of the value and convert it to its simplest form
 -- @param value the string representing the value
 -- @param paramInfo the parameter info from the objectType
@@ -488,12 +486,7 @@ local typemap = {
 -- e.g. for an integer '1', '+1 ', ' +1  ' are all valid and the simplest form
 -- is '1' so that will be returned.
 function M.checkValue(value, paramInfo, fullPath)
-  local typename = paramInfo.type
-  local checker = typemap[typename]
-  if checker then
-    return checker(value, paramInfo, fullPath)
-  end
-  fault.InvalidType("type %s is unsupported", typename)
+  return (compiled[paramInfo] or compile(paramInfo))(value, fullPath)
 end
 
 return M
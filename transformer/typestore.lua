@@ -10,8 +10,8 @@ Clear BSD License (http://directory.fsf.org/wiki/License:ClearBSD)
 See LICENSE file for more details.
 ]]
 
-local format,        gmatch,        find,        sub =
-      string.format, string.gmatch, string.find, string.sub
+local format,        gmatch,        sub,        gsub =
+      string.format, string.gmatch, string.sub, string.gsub
 local insert, concat = table.insert, table.concat
 local floor = math.floor
 local error, unpack, require, setmetatable, assert, ipairs, pairs, next, type =
@@ -24,73 +24,208 @@ local pathFinder = require("transformer.pathfinder")
 local logger = require("tch.logger")
 local xpcall = require("tch.xpcall")
 local traceback = debug.traceback
+local metrics = require("transformer.metrics")
+local now, record = metrics.now, metrics.record
 
-local stripEnd,            transformer_placeholder,            passthrough_placeholder =
-      pathFinder.stripEnd, pathFinder.transformer_placeholder, pathFinder.passthrough_placeholder
+local transformer_placeholder,            passthrough_placeholder,            compileTypePath =
+      pathFinder.transformer_placeholder, pathFinder.passthrough_placeholder, pathFinder.compileTypePath
+local typePathToObjPath = pathFinder.typePathToObjPath
 
 -- Methods available on a store.
 local TypeStore = {}
 TypeStore.__index = TypeStore
 
---- A binary search on a table for a value
--- If the value is not found, return the position where the value
--- is expected.
--- @param t the table/array to search in (without holes)
--- @param v the value to search for
--- @return the index of the matching entry if found
---      or false, the index where the entry is supposed to exist
-local function bin_search(mappings, v)
-  local first, last = 1, #mappings
+-- A segment is a placeholder if it stands for the instances of a
+-- multi instance type.
+local function is_placeholder(segment)
+  return segment == transformer_placeholder or segment == passthrough_placeholder
+end
+
+--- Find or create the index node for the given typepath.
+-- The index is a prefix tree on the typepath segments: every node holds the
+-- mapping registered on its typepath (if any), its child nodes keyed on the next
+-- segment and the sorted list of child mappings (see `TypeStore:children()`).
+-- All nodes, including the intermediate ones, are also put in a hash keyed on
+-- their full typepath so lookups never need to walk down from the root.
+-- @param self The type store.
+-- @param #string typepath The full typepath of the node.
+-- @return #table The index node.
+local function get_or_create_node(self, typepath)
+  local node = self.index[typepath]
+  if node then
+    return node
+  end
+  node = self.root
+  local path = ""
+  local dotlevel = 0
+  for segment in gmatch(typepath, "[^%.]+") do
+    path = path..segment.."."
+    if not is_placeholder(segment) then
+      dotlevel = dotlevel + 1
+    end
+    local child = node.segments[segment]
+    if not child then
+      child = { parent = node, segments = {}, kids = {}, dotlevel = dotlevel }
+      node.segments[segment] = child
+      self.index[path] = child
+    end
+    node = child
+  end
+  return node
+end
+
+--- Find the node whose mapping is the parent of the given mapping.
+-- For a multi instance mapping this skips the placeholder and the name
+-- in front of it, otherwise only the name is skipped.
+-- @param self The type store.
+-- @param #table node The index node of the mapping.
+-- @param #table mapping The mapping registered on that node.
+-- @return #table The node of the parent or nil if there is none.
+local function owner_node(self, node, mapping)
+  local owner = node.parent
+  if owner and self:isMultiInstanceMapping(mapping) then
+    owner = owner.parent
+  end
+  return owner
+end
+
+--- Insert a mapping in a list of mappings sorted on typepath.
+local function insert_sorted(kids, mapping)
+  local name = mapping.objectType.name
+  local first, last = 1, #kids
   while first <= last do
     local mid = floor((first + last)/2)
-    local compval = mappings[mid].objectType.name
-    if v == compval then
-      return mid
-    elseif v < compval then
+    if name < kids[mid].objectType.name then
       last = mid - 1
     else
       first = mid + 1
     end
   end
-  return false, first
+  insert(kids, first, mapping)
 end
 
-local transformer_pattern = transformer_placeholder.."%."
-local passthrough_pattern = passthrough_placeholder.."%."
+--- Deferred mappings.
+-- A map file can be registered with only the typepaths it provides; its
+-- mappings are loaded the first time a lookup touches one of them, one of
+-- their ancestors or anything below them. The typepaths are compared with
+-- their placeholders left out so it doesn't matter how a lookup spells
+-- the instances.
+local function strip_placeholders(typepath)
+  return (gsub(gsub(typepath, "{i}%.", ""), "@%.", ""))
+end
 
--- Calculate the tree depth of the given typepath.
--- This is done by counting the dots in the path but
--- a multi instance type only counts for 1 despite
--- having two dots (".{i}." or ".@.")
-local function calculate_dotlevel(typepath)
-  local dots = 0
-  local is = 0
-  for dot in gmatch(typepath, "%.") do
-    dots = dots + 1
+--- Check whether one of the (stripped) typepaths is a prefix of the other.
+local function overlaps(a, b)
+  if #a < #b then
+    return sub(b, 1, #a) == a
   end
-  for i in gmatch(typepath, transformer_pattern) do
-    is = is + 1
+  return sub(a, 1, #b) == b
+end
+
+--- Load the deferred units that provide mappings for the given typepath.
+-- @param self The type store.
+-- @param #string typepath The typepath about to be looked up.
+local function ensure_loaded(self, typepath)
+  local lazy = self.lazy
+  if not lazy or lazy.checked[typepath] then
+    return
   end
-  for i in gmatch(typepath, passthrough_pattern) do
-    is = is + 1
+  local stripped = strip_placeholders(typepath)
+  local pending = lazy.pending
+  local hits = {}
+  local i = 1
+  while i <= #pending do
+    local unit = pending[i]
+    local hit
+    for _, name in ipairs(unit.names) do
+      if overlaps(stripped, name) then
+        hit = true
+        break
+      end
+    end
+    if hit then
+      pending[i] = pending[#pending]
+      pending[#pending] = nil
+      hits[#hits + 1] = unit
+    else
+      i = i + 1
+    end
+  end
+  -- The units are no longer pending before they're loaded; loading them
+  -- will do lookups of its own.
+  for _, unit in ipairs(hits) do
+    lazy.deferred_kb = lazy.deferred_kb - unit.size
+    local first = #self.mappings + 1
+    unit.load()
+    lazy.loaded = lazy.loaded + 1
+    if self.eventhor then
+      self.eventhor:mappingsLoaded(self.mappings, first)
+    end
+  end
+  lazy.checked[typepath] = true
+end
+
+--- Register a map file whose mappings will be loaded on first use.
+-- @param #table typepaths The typepaths the map file registers.
+-- @param #function load The function that loads the map file.
+-- @param #number size (optional) The estimated heap size of the mappings in KiB.
+function TypeStore:defer(typepaths, load, size)
+  local lazy = self.lazy
+  if not lazy then
+    lazy = { pending = {}, checked = {}, loaded = 0, deferred = 0, deferred_kb = 0 }
+    self.lazy = lazy
+  end
+  local names = {}
+  for i, typepath in ipairs(typepaths) do
+    names[i] = strip_placeholders(typepath)
+  end
+  size = size or 0
+  lazy.pending[#lazy.pending + 1] = { names = names, load = load, size = size }
+  lazy.deferred = lazy.deferred + 1
+  lazy.deferred_kb = lazy.deferred_kb + size
+  lazy.checked = {}
+end
+
+--- Get statistics on the deferred map files.
+-- @return #table With the number of map files that were deferred, how many of
+--   them are loaded by now, how many are still pending and the estimated
+--   heap size (in KiB) of the ones still pending.
+function TypeStore:lazyStats()
+  local lazy = self.lazy
+  if not lazy then
+    return { deferred = 0, loaded = 0, pending = 0, saved_kb = 0 }
   end
-  return dots - is
+  return {
+    deferred = lazy.deferred,
+    loaded = lazy.loaded,
+    pending = #lazy.pending,
+    saved_kb = lazy.deferred_kb,
+  }
 end
 
 --- Add the given mapping to the store.
 -- @param mapping The mapping to add.
+-- @param tp_id (optional) The database ID of the typepath when it is
+--   known to be registered already.
 -- @return Nothing but raises an error if something is wrong
 --         with the mapping (e.g. it already exists).
-function TypeStore:add_mapping(mapping)
+function TypeStore:add_mapping(mapping, tp_id)
   local typepath = mapping.objectType.name
-  local found, index = bin_search(self.mappings, typepath)
-  if found then
+  local node = get_or_create_node(self, typepath)
+  if node.mapping then
     error(format("'%s' is already registered!", typepath))
   end
-  mapping.dotlevel = calculate_dotlevel(typepath)
-  mapping.tp_id = self.persistency:addTypePath(typepath)
-
-  insert(self.mappings, index, mapping)
+  mapping.dotlevel = node.dotlevel
+  mapping.tp_id = tp_id or self.persistency:addTypePath(typepath)
+  -- Object paths of this type are built often; prepare their template now.
+  compileTypePath(typepath)
+
+  node.mapping = mapping
+  local owner = owner_node(self, node, mapping)
+  if owner then
+    insert_sorted(owner.kids, mapping)
+  end
+  self.mappings[#self.mappings + 1] = mapping
 end
 
 --- Retrieve the mapping belonging to the given typepath. The given typepath
@@ -99,16 +234,11 @@ end
 -- @return #table The mapping if found.
 -- @return #nil If nothing was found.
 function TypeStore:get_mapping_exact(typepath)
-  local index = bin_search(self.mappings, typepath)
-  if not index then
-    return nil
-  end
-  return self.mappings[index]
+  ensure_loaded(self, typepath)
+  local node = self.index[typepath]
+  return node and node.mapping
 end
 
-local transformer_ending = transformer_placeholder.."."
-local passthrough_ending = passthrough_placeholder.."."
-
 --- Retrieve the mapping belonging to the given typepath. The given
 -- typepath can be incomplete with regards to the possible ending
 -- placeholder. This function will iterate over all possibilities.
@@ -116,12 +246,19 @@ local passthrough_ending = passthrough_placeholder.."."
 -- @return #table The mapping if found.
 -- @return #nil If nothing was found.
 function TypeStore:get_mapping_incomplete(typepath)
-  local mapping = self:get_mapping_exact(typepath)
+  ensure_loaded(self, typepath)
+  local node = self.index[typepath]
+  if not node then
+    return nil
+  end
+  local mapping = node.mapping
   if not mapping then
-    mapping = self:get_mapping_exact(typepath..transformer_ending)
+    local child = node.segments[transformer_placeholder]
+    mapping = child and child.mapping
   end
   if not mapping then
-    mapping = self:get_mapping_exact(typepath..passthrough_ending)
+    local child = node.segments[passthrough_placeholder]
+    mapping = child and child.mapping
   end
   return mapping
 end
@@ -132,18 +269,8 @@ end
 --         is returned if possible, nil otherwise.
 local function objtype_child_it(it_state)
   local index = it_state.index + 1
-  local dotlevel = it_state.dotlevel + 1
-  local mappings = it_state.store.mappings
-  local next_child = mappings[index]
-  while next_child and find(next_child.objectType.name, it_state.typepath, 1, true) == 1 do
-    if next_child.dotlevel == dotlevel then
-      it_state.index = index
-      return next_child
-    end
-    index = index + 1
-    next_child = mappings[index]
-  end
-  return nil
+  it_state.index = index
+  return it_state.kids[index]
 end
 
 --- Creates an iterator that will return all the direct
@@ -152,10 +279,10 @@ end
 -- @return Iterator (and iterator state) that will return the
 --         next child every time it is called.
 function TypeStore:children(mapping)
-  local typepath = mapping.objectType.name
-  local index = bin_search(self.mappings, typepath)
-  assert(index)
-  local it_state = { store = self, dotlevel = mapping.dotlevel, typepath = typepath, index = index }
+  ensure_loaded(self, mapping.objectType.name)
+  local node = self.index[mapping.objectType.name]
+  assert(node and node.mapping == mapping)
+  local it_state = { kids = node.kids, index = 0 }
   return objtype_child_it, it_state
 end
 
@@ -197,18 +324,13 @@ end
 -- @return #table The mapping of the parent if it exists.
 -- @return #nil If no parent can be found.
 function TypeStore:parent(mapping)
-    local path = mapping.objectType.name
-    if self:isMultiInstanceMapping(mapping) then
-      -- Strip the placeholder from the path.
-      path = stripEnd(path)
-    end
-    -- Strip the lowest level from the path.
-    path = stripEnd(path)
-    if #path == 0 then
-      --invalid path
-      return nil
-    end
-    return self:get_mapping_exact(path)
+  local node = self.index[mapping.objectType.name]
+  if not node then
+    return nil
+  end
+  -- The root node never has a mapping so top level mappings have no parent.
+  local owner = owner_node(self, node, mapping)
+  return owner and owner.mapping
 end
 
 --- Get the ancestor list of the given mapping
@@ -278,7 +400,7 @@ end
 -- call persistency.sync but improve the error msg by prepending the mapping path
 local function db_sync(self, mapping, entries, parent_ireferences)
   local persistency = self.persistency
-  local ok, keymap, new_keys = pcall(persistency.sync, persistency, mapping.tp_id, entries, parent_ireferences)
+  local ok, keymap, new_keys, deleted = pcall(persistency.sync, persistency, mapping.tp_id, entries, parent_ireferences)
   if not ok then
     -- include path in error msg
     if type(keymap)=='table' then
@@ -287,7 +409,31 @@ local function db_sync(self, mapping, entries, parent_ireferences)
     -- reraise
     error(keymap)
   end
-  return keymap, new_keys
+  return keymap, new_keys, deleted
+end
+
+--- Record the instances a synchronization found to be added or deleted
+-- in the change journal, together with the change of the number of
+-- entries parameter of the parent (if any).
+local function record_sync_changes(self, mapping, parent_ireferences, new_keys, deleted)
+  local typepath = mapping.objectType.name
+  local paths = {}
+  for iref in pairs(new_keys) do
+    paths[#paths + 1] = typePathToObjPath(typepath, {iref, unpack(parent_ireferences)})
+  end
+  local eventhor = self.eventhor
+  eventhor:recordChanges(paths, "add")
+  paths = {}
+  for i, irefs in ipairs(deleted or paths) do
+    paths[i] = typePathToObjPath(typepath, irefs)
+  end
+  eventhor:recordChanges(paths, "delete")
+  local numEntries = mapping.objectType.numEntriesParameter
+  local parent = numEntries and self:parent(mapping)
+  if parent then
+    local objpath = typePathToObjPath(parent.objectType.name, parent_ireferences)
+    eventhor:recordChanges({objpath .. numEntries}, "set")
+  end
 end
 
 --- Helper function to ensure we generate a unique alias.
@@ -355,8 +501,16 @@ function TypeStore:synchronize(mapping, parent_keys, parent_ireferences)
   new_aliases = {}
   local parent_irefs_string = concat(parent_ireferences, ".")
   if not mapping._entries or not mapping._entries[parent_irefs_string] then
+    local start = metrics.enabled and now()
     local entries = get_entries(mapping, parent_keys)
-    keymap, new_keys = db_sync(self, mapping, entries, parent_ireferences)
+    local deleted
+    keymap, new_keys, deleted = db_sync(self, mapping, entries, parent_ireferences)
+    if start then
+      record("sync", mapping.objectType.name, now() - start)
+    end
+    if (deleted or (new_keys and next(new_keys))) and self.eventhor and self.eventhor:isJournaling() then
+      record_sync_changes(self, mapping, parent_ireferences, new_keys, deleted)
+    end
     if mapping.objectType.aliasParameter and new_keys and next(new_keys) then
       -- First retrieve the parent DB object, so we can check the generated aliases for uniqueness.
       local known_aliases = self.persistency:getKnownAliases(mapping.tp_id, parent_ireferences)
@@ -497,6 +651,8 @@ function TypeStore:close()
   self.persistency:close()
   self.persistency = nil
   self.mappings = nil
+  self.index = nil
+  self.root = nil
 end
 
 --- Start or continue a transaction on the persistency layer.
@@ -521,12 +677,17 @@ end
 
 --- Commit a transaction on the persistency layer.
 -- @param self The type store on which to commit the transaction.
-local function commitTransaction(self, uuid)
+-- @param committed (optional) Function called once all mappings committed,
+--   before the events are sent.
+-- @return true or the nil + error message returned by `committed`
+local function commitTransaction(self, uuid, committed)
+  local ok, errmsg = true
   if self.inTransaction then
     self.persistency:commitTransaction()
-    nav.commit(self, uuid)
+    ok, errmsg = nav.commit(self, uuid, committed)
   end
   endTransaction(self)
+  return ok, errmsg
 end
 
 --- Revert a transaction on the persistency layer.
@@ -545,14 +706,25 @@ end
 -- @param #string path The path we wish to traverse.
 -- @param #string action The action to perform while navigating the tree.
 -- @param #number level 0, 1 or 2 are allowed.
+-- @param #table filter (optional) The compiled filter objects must match.
 -- NOTE: Keep this API in line with the navigate function of the navigator.
 --       For a more in depth explanation of the parameters, consult the
 --       documentation of the navigator.
 --       The client_uuid is not part of the navigator interface but added
 --       specifically for the typestore.
-local function navigateWrapper(store, client_uuid, path, action, level)
+local function navigateWrapper(store, client_uuid, path, action, level, filter)
+  startOrContinueTransaction(store, client_uuid)
+  return nav.navigate(store, path, action, level, filter)
+end
+
+--- Wrap the count function so a transaction is started if needed.
+-- @param #table store The type store.
+-- @param #string client_uuid The client UUID for the transaction.
+-- @param #string path The path whose parameters to count.
+-- @return #number The number of parameters.
+local function countWrapper(store, client_uuid, path)
   startOrContinueTransaction(store, client_uuid)
-  return nav.navigate(store, path, action, level)
+  return nav.count(store, path)
 end
 
 --- Get the client UUID for the current transaction
@@ -569,13 +741,18 @@ function TypeStore:registerEventhor(eventhor)
 end
 
 local M = {
-  new = function(persistency_location, persistency_name)
+  new = function(persistency_location, persistency_name, persistency_profile, persistency_workdir)
     local self = {
       persistency = require("transformer.persistency").new(persistency_location,
-                                                           persistency_name),
-      -- Contains the list of all registered mappings, sorted alphabetically.
-      -- In other words, the typetree is flattened depth-first.
+                                                           persistency_name,
+                                                           persistency_profile,
+                                                           persistency_workdir),
+      -- Contains the list of all registered mappings, in registration order.
       mappings = {},
+      -- Root of the prefix tree on typepath segments.
+      root = { segments = {}, kids = {}, dotlevel = 0 },
+      -- All nodes of the prefix tree keyed on their typepath.
+      index = {},
       --- Return an iterator that will walk over the tree identified
       -- by the given path.
       -- This path can be a partial or exact path.
@@ -585,6 +762,9 @@ local M = {
       --         time it is called. Throws an error if there's something
       --         wrong (path invalid, iteration finds something wrong, ...)
       navigate = navigateWrapper,
+      --- Count the parameters a getlist on the given path would return,
+      -- based on the instances known in the database.
+      count = countWrapper,
       commit = commitTransaction,
       revert = revertTransaction,
       -- Indicates if we are in a transaction or not.
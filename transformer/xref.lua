@@ -11,8 +11,8 @@ See LICENSE file for more details.
 ]]
 
 local insert, remove = table.insert, table.remove
-local pairs, ipairs, string, type, error, pcall =
-      pairs, ipairs, string, type, error, pcall
+local pairs, ipairs, string, type, error, pcall, setmetatable =
+      pairs, ipairs, string, type, error, pcall, setmetatable
 
 local M = {}
 
@@ -65,6 +65,41 @@ end
 
 local empty = {}
 
+-- Cache of resolved paths, per store:
+--   caches[store] = { generation = ..., size = ..., paths = { [typepath] = { [key] = entry } } }
+-- with entry = { path = ..., inumbers = ... }.
+-- Only successful resolves are cached. An instance found in the database
+-- keeps its instance references until it is removed again, and that
+-- changes the generation of the persistency so then the cache is dropped.
+-- The database only learns about a removal when it's synchronized, so a
+-- resolve that may sync still does that for a cached path to confirm the
+-- instance exists.
+-- Typepaths with optional single instances are never cached since their
+-- existence isn't recorded in the database.
+local caches = setmetatable({}, { __mode = "k" })
+local max_cached = 4096
+-- uncacheable[typepath] = true for typepaths with optional single instances
+local uncacheable = {}
+
+local function get_cache(store)
+  local generation = store.persistency:generation()
+  local cache = caches[store]
+  if not cache or cache.generation ~= generation or cache.size >= max_cached then
+    cache = { generation = generation, size = 0, paths = {} }
+    caches[store] = cache
+  end
+  return cache
+end
+
+local function has_optional_single_instance(store, maplist)
+  for _, mapping in ipairs(maplist) do
+    if store:isOptionalSingleInstanceMapping(mapping) then
+      return true
+    end
+  end
+  return false
+end
+
 -- Actual resolve implementation. This function should be pcall()'d.
 local function resolve_impl(store, typepath, key, no_sync)
   local inumbers, path, last_multi_tpid
@@ -73,6 +108,26 @@ local function resolve_impl(store, typepath, key, no_sync)
     return
   end
 
+  local cache, cached_paths
+  if not uncacheable[typepath] then
+    cache = get_cache(store)
+    cached_paths = cache.paths[typepath]
+    local cached = cached_paths and cached_paths[key]
+    if cached then
+      if no_sync or not cached.inumbers then
+        return cached.path
+      end
+      local ok, err = pcall(store.getkeys, store, store:collectMappings(typepath), cached.inumbers, empty)
+      if ok then
+        return cached.path
+      end
+      -- the instance is gone
+      cached_paths[key] = nil
+      cache.size = cache.size - 1
+      error(err, 0)
+    end
+  end
+
   -- build the maplist.
   -- This is needed as we need to query the database with a multi-instance
   -- typepath. Leaf single instance objects are not stored in the DB.
@@ -83,6 +138,10 @@ local function resolve_impl(store, typepath, key, no_sync)
   if maplist[#maplist].objectType.name ~= typepath then
     return
   end
+  if cache and has_optional_single_instance(store, maplist) then
+    uncacheable[typepath] = true
+    cache = nil
+  end
   if last_multi then
     last_multi_tpid = last_multi.tp_id
     -- try to find the given object in the DB
@@ -114,7 +173,16 @@ local function resolve_impl(store, typepath, key, no_sync)
 
   if path then
     -- remove the ending dot
-    return (path:gsub("%.$", ""))
+    path = path:gsub("%.$", "")
+    if cache then
+      if not cached_paths then
+        cached_paths = {}
+        cache.paths[typepath] = cached_paths
+      end
+      cached_paths[key] = { path = path, inumbers = inumbers }
+      cache.size = cache.size + 1
+    end
+    return path
   end
 end
 